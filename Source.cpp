@@ -8,6 +8,50 @@
 #include <random>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cmath>
+#include <memory>
+#include <chrono>
+#include <cwchar>
+#include <filesystem>
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <intrin.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__BMI2__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define MARGOLUS_PDEP 1
+#include <immintrin.h>
+#endif
 #pragma execution_character_set("utf-8")
 
 // Размеры сетки должны быть кратны 2 по обеим осям
@@ -16,6 +60,7 @@ const int GRID_W = 160;  // ширина сетки в ячейках (долж
 const int GRID_H = 120;  // высота сетки в ячейках (должна быть чётной)
 
 using Block = std::array<int, 4>; // порядок: левый верхний, правый верхний, левый нижний, правый нижний
+using Cell = uint8_t;             // состояние ячейки в сетке (по байту на ячейку)
 
 // Вспомогательная функция: горизонтальное отражение блока
 Block mirror_h(const Block& b) {
@@ -70,113 +115,3722 @@ std::vector<Rule> build_sand_rules() {
     return rules;
 }
 
+// Вариант правил для сравнения A/B: те же правила без зеркальных копий (песок осыпается только в одну сторону)
+std::vector<Rule> build_sand_rules_asymmetric() {
+    std::vector<Rule> rules = build_sand_rules();
+    for (auto& r : rules) r.horizontal_reflection = false;
+    return rules;
+}
+
+// Применение набора правил к блоку перебором (первое подходящее правило, с учётом зеркальных копий).
+// Возвращает true, если какое-либо правило сработало; результат записывается в out.
+bool apply_rules(const std::vector<Rule>& rules, const Block& b, Block& out) {
+    for (const auto& r : rules) {
+        // прямое совпадение
+        if (match_pattern(r.in, b)) {
+            out = apply_output_template(r.out, b);
+            return true;
+        }
+        // если правило симметрично — проверяем зеркальную копию
+        if (r.horizontal_reflection) {
+            Block mb = mirror_h(b);
+            if (match_pattern(r.in, mb)) {
+                out = mirror_h(apply_output_template(r.out, mb));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Материал — описание состояния, из которого выводятся правила: более плотное вещество опускается
+// сквозь менее плотное, сыпучее осыпается по диагонали, жидкое ещё и растекается по горизонтали,
+// твёрдое неподвижно и не вытесняется; источник порождает своё вещество в пустую ячейку под собой
+struct Material {
+    const char* name;
+    int density = 0;     // плотность (у пустоты 0)
+    bool fluid = false;  // растекается по горизонтали
+    bool solid = false;  // неподвижен и не вытесняется
+    int emits = -1;      // порождаемое состояние (-1 — не источник)
+};
+
+// Набор материалов по умолчанию: индекс в векторе — номер состояния
+std::vector<Material> default_materials() {
+    return {
+        Material{ "пусто", 0 },
+        Material{ "песок", 3 },
+        Material{ "грунт", 0, false, true },
+        Material{ "источник", 0, false, true, 1 },
+        Material{ "вода", 2, true },
+        Material{ "масло", 1, true },
+    };
+}
+
+// Вывод правил из материалов. Порядок — как в build_sand_rules(): падение пары, падение одной ячейки,
+// осыпание по диагонали, затем растекание и источники; все правила с зеркальной копией.
+// Для состояний 0..3 по умолчанию получаются ровно правила песка.
+std::vector<Rule> build_material_rules(const std::vector<Material>& m) {
+    const int n = int(m.size());
+    // пары (тяжёлое, лёгкое): тяжёлое может поменяться местами с лёгким, лежащим под ним или рядом
+    std::vector<std::pair<int, int>> sinks;
+    for (int hv = 0; hv < n; ++hv)
+        for (int lt = 0; lt < n; ++lt)
+            if (!m[hv].solid && !m[lt].solid && m[hv].density > m[lt].density) sinks.push_back({ hv, lt });
+    std::vector<Rule> rules;
+    // h1, h2, l1, l2 → l1, l2, h1, h2: обе ячейки верхней строки тонут одновременно
+    for (auto a : sinks)
+        for (auto b : sinks)
+            rules.push_back(Rule{ Block{ a.first, b.first, a.second, b.second }, Block{ a.second, b.second, a.first, b.first }, true });
+    // h, x, l, y → l, x, h, y
+    for (auto p : sinks)
+        rules.push_back(Rule{ Block{ p.first, -1, p.second, -1 }, Block{ p.second, -1, p.first, -1 }, true });
+    // h, l, x, l → l, l, x, h
+    for (auto p : sinks)
+        rules.push_back(Rule{ Block{ p.first, p.second, -1, p.second }, Block{ p.second, p.second, -1, p.first }, true });
+    // растекание в нижней и верхней строке: f, l → l, f
+    for (auto p : sinks) {
+        if (!m[p.first].fluid) continue;
+        rules.push_back(Rule{ Block{ -1, -1, p.first, p.second }, Block{ -1, -1, p.second, p.first }, true });
+        rules.push_back(Rule{ Block{ p.first, p.second, -1, -1 }, Block{ p.second, p.first, -1, -1 }, true });
+    }
+    // s, x, 0, y → s, x, e, y
+    for (int s = 0; s < n; ++s)
+        if (m[s].emits >= 0)
+            rules.push_back(Rule{ Block{ s, -1, 0, -1 }, Block{ s, -1, m[s].emits, -1 }, true });
+    return rules;
+}
+
+// Наборы правил по номеру (для смены правил командой редактирования)
+const int RULE_SETS = 3;
+std::vector<Rule> rule_set(int id) {
+    if (id == 1) return build_sand_rules_asymmetric();
+    if (id == 2) return build_material_rules(default_materials());
+    return build_sand_rules();
+}
+
+// Таблица переходов строится для состояний 0..states-1 (states^4 записей): не меньше TABLE_STATES
+// (4^4 = 256 записей для песка), не больше MAX_TABLE_STATES (8^4 = 4096 записей)
+const int TABLE_STATES = 4;
+const int MAX_TABLE_STATES = 8;
+
+// Все наборы правил программы укладываются в MAX_TABLE_STATES состояний; ячейки с большими значениями
+// в данных извне (контрольные точки, штампы, сеть) считаются повреждением и отвергаются
+inline bool valid_states(const std::vector<Cell>& cells) {
+    for (Cell c : cells)
+        if (c >= MAX_TABLE_STATES) return false;
+    return true;
+}
+
+inline int block_index(const Block& b, int states) {
+    return b[0] + states * (b[1] + states * (b[2] + states * b[3]));
+}
+
+// Запись скомпилированной таблицы переходов
+struct Transition {
+    Block out{};                      // выходной блок
+    bool changes = false;             // отличается ли выход от входа
+    std::array<signed char, 4> src{}; // для каждой выходной позиции — входная позиция зерна (-1 — новое зерно или пусто)
+    // Поток зёрен через внутренние границы блока: flux_down[c] — вниз через горизонтальную границу
+    // в столбце c (по столбцу назначения), flux_right[r] — вправо через вертикальную границу в строке r
+    std::array<signed char, 2> flux_down{}, flux_right{};
+    bool has_flux = false;
+};
+
+// Перестановка ячеек блока: сначала неподвижные ячейки, затем зёрна того же состояния по порядку.
+// Зерно без пары во входе считается новым (например, порождённым источником).
+std::array<signed char, 4> block_permutation(const Block& in, const Block& out) {
+    std::array<signed char, 4> src{ -1, -1, -1, -1 };
+    bool used[4] = { false, false, false, false };
+    for (int i = 0; i < 4; ++i)
+        if (out[i] != 0 && in[i] == out[i]) { src[i] = (signed char)i; used[i] = true; }
+    for (int i = 0; i < 4; ++i) {
+        if (out[i] == 0 || src[i] >= 0) continue;
+        for (int j = 0; j < 4; ++j)
+            if (!used[j] && in[j] == out[i]) { src[i] = (signed char)j; used[j] = true; break; }
+    }
+    return src;
+}
+
+// Запись перехода для пары вход/выход: перестановка и потоки через внутренние границы
+Transition make_transition(const Block& in, const Block& out) {
+    Transition t;
+    t.out = out;
+    t.changes = out != in;
+    t.src = block_permutation(in, out);
+    for (int i = 0; i < 4; ++i) {
+        int j = t.src[i];
+        if (j < 0 || j == i) continue;
+        t.flux_down[i & 1] += (signed char)((i >> 1) - (j >> 1)); // строка: 0 — верхняя, 1 — нижняя
+        t.flux_right[i >> 1] += (signed char)((i & 1) - (j & 1)); // столбец: 0 — левый, 1 — правый
+    }
+    t.has_flux = t.flux_down[0] || t.flux_down[1] || t.flux_right[0] || t.flux_right[1];
+    return t;
+}
+
+// Компиляция правил в таблицу: результат совпадает с перебором apply_rules для каждого блока
+std::vector<Transition> compile_rules(const std::vector<Rule>& rules, int states = TABLE_STATES) {
+    std::vector<Transition> table(size_t(states) * states * states * states);
+    for (int idx = 0; idx < int(table.size()); ++idx) {
+        Block b{ idx % states, (idx / states) % states, (idx / states / states) % states, idx / states / states / states };
+        Block out = b;
+        apply_rules(rules, b, out);
+        table[idx] = make_transition(b, out);
+    }
+    return table;
+}
+
+// Число состояний таблицы для набора правил; 0 — правила не помещаются в таблицу
+int rules_table_states(const std::vector<Rule>& rules) {
+    int states = TABLE_STATES;
+    for (const auto& r : rules)
+        for (int i = 0; i < 4; ++i) states = std::max(states, std::max(r.in[i], r.out[i]) + 1);
+    return states <= MAX_TABLE_STATES ? states : 0;
+}
+
+// Сопоставитель правил без таблицы переходов (много состояний): граф решений по четырём ячейкам блока.
+// Узел ветвится по значению одной ячейки и соответствует множеству ещё возможных вариантов правил
+// (зеркальные копии — отдельные варианты сразу за исходным); узлы с одинаковым множеством общие.
+// Сопоставление — не более 4 обращений к массиву независимо от числа правил.
+// Первые PROFILE_STEPS поколений после построения собирается профиль частот блоков (каждый 8-й блок);
+// затем самые частые блоки вместе с готовым результатом (чаще всего «ни одно правило не подходит»)
+// попадают в кэш горячих блоков, и для них сопоставление сводится к одному сравнению ключа.
+struct RuleMatcher {
+    struct Variant { Block in, out; };
+    struct Node { int pos, base, span, def; }; // ячейка ветвления, дети по значениям [0, span), иначе def
+    std::vector<Variant> variants; // в порядке приоритета
+    std::vector<Node> nodes;
+    std::vector<int> edges;
+    // Ссылка: >= 0 — узел, -1 — ни одно правило не подходит, <= -2 — вариант -(ref + 2)
+    int root = -1;
+
+    static const int HOT = 256, PROFILE_STEPS = 64;
+    std::array<uint64_t, HOT> hot_key; // упакованный блок (~0 — пустой слот)
+    std::array<int, HOT> hot_ref;
+    std::unordered_map<uint32_t, long long> profile;
+    bool profiling = false;
+    int profile_steps = 0;
+    unsigned sample_tick = 0;
+
+    RuleMatcher() { hot_key.fill(~0ull); }
+
+    static uint32_t pack(const Block& b) {
+        return uint32_t(b[0] & 0xff) | uint32_t(b[1] & 0xff) << 8 | uint32_t(b[2] & 0xff) << 16 | uint32_t(b[3] & 0xff) << 24;
+    }
+    static size_t hot_slot(uint32_t k) { return size_t((k * 0x9e3779b1u) >> 24); }
+
+    // Начать сбор профиля заново (например, после смены сценария)
+    void reprofile() {
+        hot_key.fill(~0ull);
+        profile.clear();
+        profiling = true;
+        profile_steps = 0;
+    }
+
+    // Конец поколения: по окончании разогрева кэш заполняется блоками в порядке убывания частоты
+    void end_step() {
+        if (!profiling || ++profile_steps < PROFILE_STEPS) return;
+        std::vector<std::pair<long long, uint32_t>> freq;
+        for (const auto& kv : profile) freq.push_back({ kv.second, kv.first });
+        std::sort(freq.begin(), freq.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+        for (const auto& f : freq) {
+            size_t s = hot_slot(f.second);
+            if (hot_key[s] != ~0ull) continue;
+            Block b{ int(f.second & 0xff), int((f.second >> 8) & 0xff), int((f.second >> 16) & 0xff), int(f.second >> 24) };
+            hot_key[s] = f.second;
+            hot_ref[s] = lookup(b);
+        }
+        profile.clear();
+        profiling = false;
+    }
+
+    void build(const std::vector<Rule>& rules) {
+        variants.clear(); nodes.clear(); edges.clear();
+        reprofile();
+        for (const auto& r : rules) {
+            variants.push_back(Variant{ r.in, r.out });
+            Variant m{ mirror_h(r.in), mirror_h(r.out) };
+            if (r.horizontal_reflection && (m.in != r.in || m.out != r.out)) variants.push_back(m);
+        }
+        std::vector<int> all(variants.size());
+        for (size_t i = 0; i < all.size(); ++i) all[i] = int(i);
+        std::map<std::vector<int>, int> memo[4];
+        root = make(0, all, memo);
+    }
+
+    int make(int pos, const std::vector<int>& cand, std::map<std::vector<int>, int>* memo) {
+        if (cand.empty()) return -1;
+        // первый вариант не проверяет оставшиеся ячейки — он и выигрывает
+        bool rest_free = true;
+        for (int i = pos; i < 4; ++i) rest_free &= variants[cand[0]].in[i] == -1;
+        if (rest_free) return -(cand[0] + 2);
+        auto it = memo[pos].find(cand);
+        if (it != memo[pos].end()) return it->second;
+        std::vector<int> values, wild;
+        for (int c : cand) {
+            int v = variants[c].in[pos];
+            if (v == -1) wild.push_back(c);
+            else if (std::find(values.begin(), values.end(), v) == values.end()) values.push_back(v);
+        }
+        int def = make(pos + 1, wild, memo);
+        int ref = def;
+        if (!values.empty()) {
+            Node n{ pos, 0, *std::max_element(values.begin(), values.end()) + 1, def };
+            std::vector<int> child(size_t(n.span), def);
+            for (int v : values) {
+                std::vector<int> sub;
+                for (int c : cand)
+                    if (variants[c].in[pos] == -1 || variants[c].in[pos] == v) sub.push_back(c);
+                child[size_t(v)] = make(pos + 1, sub, memo);
+            }
+            n.base = int(edges.size());
+            edges.insert(edges.end(), child.begin(), child.end());
+            ref = int(nodes.size());
+            nodes.push_back(n);
+        }
+        memo[pos][cand] = ref;
+        return ref;
+    }
+
+    // Проход по графу: ссылка на сработавший вариант или -1
+    int lookup(const Block& b) const {
+        int ref = root;
+        while (ref >= 0) {
+            const Node& n = nodes[size_t(ref)];
+            int v = b[n.pos];
+            ref = unsigned(v) < unsigned(n.span) ? edges[size_t(n.base + v)] : n.def;
+        }
+        return ref;
+    }
+
+    // То же, что apply_rules(): true и выходной блок в out, если какое-либо правило сработало
+    bool match(const Block& b, Block& out) {
+        uint32_t k = pack(b);
+        size_t s = hot_slot(k);
+        int ref = hot_key[s] == k ? hot_ref[s] : lookup(b);
+        if (profiling && (++sample_tick & 7) == 0) ++profile[k];
+        if (ref == -1) return false;
+        out = apply_output_template(variants[size_t(-ref - 2)].out, b);
+        return true;
+    }
+};
+
+// Зонд потока: отрезок границы между ячейками, через который считается перенос песка.
+// Горизонтальный зонд лежит между строками pos-1 и pos (положительно — вниз) и покрывает столбцы [from, to);
+// вертикальный — между столбцами pos-1 и pos (положительно — вправо) и покрывает строки [from, to).
+struct FluxProbe {
+    bool horizontal = true;
+    int pos = 0, from = 0, to = 0;
+    long long total = 0;       // суммарный поток с момента регистрации
+    int current = 0;           // поток за текущий шаг
+    std::vector<int> series;   // поток по поколениям (последние, см. SERIES_MAX)
+    long long series_first = 0; // series[0] — поток шага из поколения series_first в series_first + 1
+    static const size_t SERIES_MAX = size_t(1) << 16; // больше 2 * SERIES_MAX шагов не хранится
+};
+
+// Точка траектории отслеживаемого зерна
+struct TracePoint {
+    long long gen;
+    uint32_t id;
+    int x, y;
+};
+
+// Параллельный обход: задания 0..n-1 раздаются потокам через атомарный счётчик
+template <class Fn>
+void parallel_for(int n, int threads, Fn fn) {
+    threads = std::max(1, std::min(threads, n));
+    std::atomic<int> next{ 0 };
+    auto work = [&](int t) { for (int i; (i = next++) < n;) fn(i, t); };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t) pool.emplace_back(work, t);
+    work(0);
+    for (auto& th : pool) th.join();
+}
+
+// Волновой фронт по кольцу полос: run(b, g) выполняет поколение g (от начала пачки) в полосе b, как только
+// полоса и обе соседние закончили g - 1 (атомарный счётчик done у каждой полосы). Общих барьеров нет;
+// поток владеет непрерывным участком полос и ждёт только соседей на его краях. Нужно bands >= 3,
+// иначе соседние полосы пересекаются — тогда всё выполняется в одном потоке.
+// Возвращает суммарное время работы потоков без ожидания соседей, нс.
+template <class Fn>
+uint64_t wavefront(int bands, int threads, long long n, Fn run) {
+    using clock = std::chrono::steady_clock;
+    if (bands < 3) threads = 1;
+    threads = std::max(1, std::min(threads, bands));
+    struct alignas(64) Done { std::atomic<long long> g{ 0 }; }; // число завершённых поколений
+    std::vector<Done> done(static_cast<size_t>(bands));
+    std::atomic<uint64_t> busy{ 0 };
+    parallel_for(threads, threads, [&](int t, int) {
+        const auto start = clock::now();
+        clock::duration waited{ 0 };
+        int b0 = t * bands / threads, b1 = (t + 1) * bands / threads;
+        for (long long g = 0; g < n; ++g)
+            for (int b = b0; b < b1; ++b) {
+                const auto& l = done[size_t((b + bands - 1) % bands)].g;
+                const auto& r = done[size_t((b + 1) % bands)].g;
+                if (l.load(std::memory_order_acquire) < g || r.load(std::memory_order_acquire) < g) {
+                    const auto w0 = clock::now();
+                    while (l.load(std::memory_order_acquire) < g || r.load(std::memory_order_acquire) < g)
+                        std::this_thread::yield();
+                    waited += clock::now() - w0;
+                }
+                run(b, g);
+                done[size_t(b)].g.store(g + 1, std::memory_order_release);
+            }
+        busy += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start - waited).count());
+    });
+    return busy;
+}
+
+inline int popcount64(uint64_t x) {
+#ifdef _MSC_VER
+    return int(__popcnt64(x));
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+inline int default_threads() { return std::max(1, int(std::thread::hardware_concurrency())); }
+
+// Счётчиковый генератор случайных чисел: значение — чистая функция (seed, поток, x, y),
+// поэтому результат не зависит ни от порядка обхода, ни от числа потоков
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t counter_random(uint64_t seed, uint32_t stream, uint32_t x, uint32_t y) {
+    return mix64(mix64(seed + 0x9e3779b97f4a7c15ull * (uint64_t(stream) + 1)) ^ ((uint64_t(y) << 32) | x));
+}
+
+inline float counter_uniform(uint64_t seed, uint32_t stream, uint32_t x, uint32_t y) {
+    return float(counter_random(seed, stream, x, y) >> 40) * (1.0f / 16777216.0f);
+}
+
+// Прямоугольный фрагмент сетки (буфер обмена и шаблоны-штампы)
+struct Region {
+    int w = 0, h = 0;
+    std::vector<Cell> cells; // построчно, w * h
+
+    Region() {}
+    Region(int W, int H) : w(W), h(H), cells(size_t(W) * H, 0) {}
+
+    Cell& at(int x, int y) { return cells[size_t(y) * w + x]; }
+    int at(int x, int y) const { return cells[size_t(y) * w + x]; }
+
+    // Поворот на 90° по часовой стрелке
+    Region rotated() const {
+        Region r(h, w);
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x) r.at(h - 1 - y, x) = at(x, y);
+        return r;
+    }
+
+    // Зеркальное отражение по горизонтали
+    Region mirrored() const {
+        Region r = *this;
+        for (int y = 0; y < h; ++y) std::reverse(r.cells.begin() + size_t(y) * w, r.cells.begin() + size_t(y + 1) * w);
+        return r;
+    }
+};
+
+// Встроенные штампы: воронка, бункер с источником и лабиринт из грунта
+std::vector<std::pair<std::string, Region>> builtin_stamps() {
+    std::vector<std::pair<std::string, Region>> lib;
+    Region funnel(24, 12);
+    for (int y = 0; y < 12; ++y) { funnel.at(y, y) = 2; funnel.at(23 - y, y) = 2; }
+    funnel.at(11, 11) = funnel.at(12, 11) = 0; // горловина
+    lib.push_back({ "funnel", funnel });
+
+    Region hopper(16, 14);
+    for (int x = 2; x < 14; ++x) hopper.at(x, 0) = 3;
+    for (int y = 2; y < 14; ++y) { hopper.at(0, y) = 2; hopper.at(15, y) = 2; }
+    for (int x = 0; x < 16; ++x) if (x < 7 || x > 8) hopper.at(x, 13) = 2;
+    lib.push_back({ "hopper", hopper });
+
+    Region maze(32, 32);
+    for (int y = 0; y < 32; y += 6)
+        for (int x = 0; x < 32; ++x)
+            if ((x / 8 + y / 6) % 2 == 0 || x % 8 < 5) maze.at(x, y) = 2;
+    for (int y = 3; y < 32; y += 6) maze.at((y * 7) % 32, y) = 2;
+    lib.push_back({ "maze", maze });
+    return lib;
+}
+
+// Z-порядок: биты x — в чётные разряды кода, биты y — в нечётные (координаты до 2^16).
+// С BMI2 перемежение и обратное преобразование — по одной инструкции PDEP / PEXT.
+inline uint32_t morton_encode(uint32_t x, uint32_t y) {
+#ifdef MARGOLUS_PDEP
+    return _pdep_u32(x, 0x55555555u) | _pdep_u32(y, 0xaaaaaaaau);
+#else
+    auto spread = [](uint32_t v) {
+        v &= 0xffff;
+        v = (v | (v << 8)) & 0x00ff00ffu;
+        v = (v | (v << 4)) & 0x0f0f0f0fu;
+        v = (v | (v << 2)) & 0x33333333u;
+        return (v | (v << 1)) & 0x55555555u;
+    };
+    return spread(x) | (spread(y) << 1);
+#endif
+}
+
+inline void morton_decode(uint32_t m, int& x, int& y) {
+#ifdef MARGOLUS_PDEP
+    x = int(_pext_u32(m, 0x55555555u));
+    y = int(_pext_u32(m, 0xaaaaaaaau));
+#else
+    auto compact = [](uint32_t v) {
+        v &= 0x55555555u;
+        v = (v | (v >> 1)) & 0x33333333u;
+        v = (v | (v >> 2)) & 0x0f0f0f0fu;
+        v = (v | (v >> 4)) & 0x00ff00ffu;
+        return (v | (v >> 8)) & 0xffffu;
+    };
+    x = int(compact(m));
+    y = int(compact(m >> 1));
+#endif
+}
+
+// Хранилище сетки фрагментами CHUNK×CHUNK, которые лежат в памяти вдоль Z-кривой; внутри фрагмента ячейки
+// идут построчно или тоже в Z-порядке (inner_morton). Соседи по вертикали оказываются в пределах
+// одного фрагмента (4 КБ) вместо w байт друг от друга. Фрагменты на правом и нижнем краю неполные.
+struct MortonGrid {
+    static const int LOG = 6, CHUNK = 1 << LOG;
+    int w = 0, h = 0, cw = 0, ch = 0;
+    bool inner_morton = false;
+    std::vector<uint32_t> slot;              // место фрагмента (cy * cw + cx) в памяти
+    std::vector<std::array<int, 2>> order;   // фрагменты в порядке хранения
+    std::vector<Cell> data;
+
+    void init(int W, int H, bool inner) {
+        w = W; h = H; inner_morton = inner;
+        cw = (w + CHUNK - 1) >> LOG;
+        ch = (h + CHUNK - 1) >> LOG;
+        std::vector<std::pair<uint32_t, int>> codes;
+        for (int cy = 0; cy < ch; ++cy)
+            for (int cx = 0; cx < cw; ++cx) codes.push_back({ morton_encode(uint32_t(cx), uint32_t(cy)), cy * cw + cx });
+        std::sort(codes.begin(), codes.end());
+        slot.assign(codes.size(), 0);
+        order.clear();
+        for (size_t k = 0; k < codes.size(); ++k) {
+            slot[size_t(codes[k].second)] = uint32_t(k);
+            order.push_back({ codes[k].second % cw, codes[k].second / cw });
+        }
+        data.assign(codes.size() << (2 * LOG), 0);
+    }
+
+    size_t index(int x, int y) const {
+        size_t base = size_t(slot[size_t(y >> LOG) * cw + (x >> LOG)]) << (2 * LOG);
+        uint32_t lx = uint32_t(x & (CHUNK - 1)), ly = uint32_t(y & (CHUNK - 1));
+        return base + (inner_morton ? morton_encode(lx, ly) : (ly << LOG | lx));
+    }
+
+    // Перенос строки фрагментов cy из построчной сетки и обратно (для отрисовки, статистики и контрольных точек).
+    // Без inner_morton строка фрагмента — непрерывный отрезок, копируется целиком.
+    template <bool Load, class Cells>
+    void copy_row(Cells& cells, int cy) {
+        for (int cx = 0; cx < cw; ++cx) {
+            const int X0 = cx << LOG, n = std::min(w, X0 + CHUNK) - X0;
+            Cell* base = &data[size_t(slot[size_t(cy) * cw + cx]) << (2 * LOG)];
+            for (int y = cy << LOG; y < std::min(h, (cy + 1) << LOG); ++y) {
+                auto* row = &cells[size_t(y) * w + X0];
+                uint32_t ly = uint32_t(y & (CHUNK - 1));
+                if (!inner_morton) {
+                    if (Load) std::memcpy(base + (ly << LOG), row, size_t(n));
+                    else std::memcpy(const_cast<Cell*>(row), base + (ly << LOG), size_t(n));
+                    continue;
+                }
+                for (int lx = 0; lx < n; ++lx) {
+                    Cell& c = base[morton_encode(uint32_t(lx), ly)];
+                    if (Load) c = row[lx];
+                    else const_cast<Cell&>(row[lx]) = c;
+                }
+            }
+        }
+    }
+    void load(const std::vector<Cell>& cells, int cy) { copy_row<true>(cells, cy); }
+    void store(std::vector<Cell>& cells, int cy) { copy_row<false>(cells, cy); }
+
+    // Одна фаза разбиения в строке фрагментов cy. Блок принадлежит фрагменту своего левого верхнего угла;
+    // при смещении блоки на правом и нижнем краю фрагмента (и сетки — с зацикливанием) читают соседние
+    // фрагменты, в том числе верхнюю строку фрагментов cy + 1. Без смещения блок 2×2 целиком внутри фрагмента,
+    // а в Z-порядке это четыре подряд идущих байта.
+    // delta — изменение population; в changed дописываются y0 * w + x0 изменившихся блоков.
+    void step(const std::vector<Transition>& table, int states, bool offset, int cy,
+        std::vector<long long>& delta, std::vector<int>& changed) {
+        const int o = offset ? 1 : 0;
+        Cell* d = data.data();
+        for (int cx = 0; cx < cw; ++cx) {
+            const size_t k = slot[size_t(cy) * cw + cx];
+            const int X0 = cx << LOG, Y0 = cy << LOG;
+            const int X1 = std::min(w, X0 + CHUNK), Y1 = std::min(h, Y0 + CHUNK);
+            const size_t base = k << (2 * LOG);
+            const size_t dy = inner_morton ? 2 : CHUNK; // шаг к нижней ячейке блока, выровненного по чётным координатам
+            for (int y0 = Y0 + o; y0 < Y1; y0 += 2)
+                for (int x0 = X0 + o; x0 < X1; x0 += 2) {
+                    size_t p[4];
+                    uint32_t lx = uint32_t(x0 - X0), ly = uint32_t(y0 - Y0);
+                    if (!o || (!inner_morton && x0 + 1 < X1 && y0 + 1 < Y1)) {
+                        size_t q = base + (inner_morton ? morton_encode(lx, ly) : (ly << LOG | lx));
+                        p[0] = q; p[1] = q + 1; p[2] = q + dy; p[3] = q + dy + 1;
+                    }
+                    else {
+                        int x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+                        p[0] = index(x0, y0); p[1] = index(x1, y0);
+                        p[2] = index(x0, y1); p[3] = index(x1, y1);
+                    }
+                    Block in{ d[p[0]], d[p[1]], d[p[2]], d[p[3]] };
+                    const Transition& t = table[block_index(in, states)];
+                    if (!t.changes) continue;
+                    for (int i = 0; i < 4; ++i) {
+                        d[p[i]] = Cell(t.out[i]);
+                        if (t.out[i] != in[i]) { --delta[in[i]]; ++delta[t.out[i]]; }
+                    }
+                    changed.push_back(y0 * w + x0);
+                }
+        }
+    }
+};
+
+// Таблица сумм по площади (интегральное изображение) для числа ячеек одного состояния.
+// Сетка делится на тайлы TILE×TILE: в каждом тайле — локальная таблица сумм, а префиксы по полосам
+// тайлов и по целым тайлам дают S(x, y) — число ячеек в [0, x) × [0, y) — за O(1).
+// Изменения только помечают тайлы грязными; пересчёт выполняется при следующем запросе и затрагивает
+// грязные тайлы и префиксы их полос.
+struct AreaSums {
+    static const int TILE = 32;
+    static const int L = TILE + 1;  // сторона локальной таблицы
+    int state = 1;
+    int w = 0, h = 0, tw = 0, th = 0;
+    std::vector<uint16_t> local;        // [тайл][ly][lx]: ячейки в [0, lx) × [0, ly) тайла
+    std::vector<int> row_prefix;        // [ty][tx][ly]: первые ly строк тайлов левее tx в полосе ty
+    std::vector<int> col_prefix;        // [tx][ty][lx]: первые lx столбцов тайлов выше ty в столбце tx
+    std::vector<long long> tile_prefix; // [ty][tx], (tw+1)×(th+1): целые тайлы в [0, tx) × [0, ty)
+    std::vector<uint8_t> dirty;
+    bool any_dirty = true;
+
+    void reset(int W, int H, int s) {
+        state = s; w = W; h = H;
+        tw = (w + TILE - 1) / TILE; th = (h + TILE - 1) / TILE;
+        local.assign(size_t(tw) * th * L * L, 0);
+        row_prefix.assign(size_t(th) * tw * L, 0);
+        col_prefix.assign(size_t(tw) * th * L, 0);
+        tile_prefix.assign(size_t(tw + 1) * (th + 1), 0);
+        dirty.assign(size_t(tw) * th, 1);
+        any_dirty = true;
+    }
+
+    // Пометка изменившейся ячейки / прямоугольника [x0, x1] × [y0, y1] (включительно)
+    void touch(int x, int y) { dirty[size_t(y / TILE) * tw + x / TILE] = 1; any_dirty = true; }
+    void touch(int x0, int y0, int x1, int y1) {
+        for (int ty = std::max(0, y0) / TILE; ty <= std::min(h - 1, y1) / TILE; ++ty)
+            for (int tx = std::max(0, x0) / TILE; tx <= std::min(w - 1, x1) / TILE; ++tx) dirty[size_t(ty) * tw + tx] = 1;
+        any_dirty = true;
+    }
+    void touch_all() { std::fill(dirty.begin(), dirty.end(), 1); any_dirty = true; }
+
+    uint16_t* tile(int tx, int ty) { return &local[(size_t(ty) * tw + tx) * L * L]; }
+
+    // Пересчёт грязных тайлов и префиксов их полос
+    void refresh(const std::vector<Cell>& cells) {
+        if (!any_dirty) return;
+        std::vector<uint8_t> band_row(th, 0), band_col(tw, 0);
+        for (int ty = 0; ty < th; ++ty)
+            for (int tx = 0; tx < tw; ++tx) {
+                if (!dirty[size_t(ty) * tw + tx]) continue;
+                dirty[size_t(ty) * tw + tx] = 0;
+                band_row[ty] = band_col[tx] = 1;
+                uint16_t* t = tile(tx, ty);
+                for (int ly = 1; ly < L; ++ly) {
+                    int y = ty * TILE + ly - 1;
+                    uint16_t run = 0;
+                    for (int lx = 1; lx < L; ++lx) {
+                        int x = tx * TILE + lx - 1;
+                        if (x < w && y < h && cells[size_t(y) * w + x] == state) ++run;
+                        t[ly * L + lx] = uint16_t(t[(ly - 1) * L + lx] + run);
+                    }
+                }
+            }
+        for (int ty = 0; ty < th; ++ty) {
+            if (!band_row[ty]) continue;
+            int* rp = &row_prefix[size_t(ty) * tw * L];
+            for (int tx = 1; tx < tw; ++tx)
+                for (int ly = 0; ly < L; ++ly) rp[tx * L + ly] = rp[(tx - 1) * L + ly] + tile(tx - 1, ty)[ly * L + TILE];
+        }
+        for (int tx = 0; tx < tw; ++tx) {
+            if (!band_col[tx]) continue;
+            int* cp = &col_prefix[size_t(tx) * th * L];
+            for (int ty = 1; ty < th; ++ty)
+                for (int lx = 0; lx < L; ++lx) cp[ty * L + lx] = cp[(ty - 1) * L + lx] + tile(tx, ty - 1)[TILE * L + lx];
+        }
+        for (int ty = 1; ty <= th; ++ty)
+            for (int tx = 1; tx <= tw; ++tx)
+                tile_prefix[size_t(ty) * (tw + 1) + tx] = tile_prefix[size_t(ty - 1) * (tw + 1) + tx]
+                    + tile_prefix[size_t(ty) * (tw + 1) + tx - 1] - tile_prefix[size_t(ty - 1) * (tw + 1) + tx - 1]
+                    + tile(tx - 1, ty - 1)[TILE * L + TILE];
+        any_dirty = false;
+    }
+
+    // S(x, y) для 0 <= x <= w, 0 <= y <= h (таблица должна быть актуальной)
+    long long prefix(int x, int y) {
+        if (x <= 0 || y <= 0) return 0;
+        int tx = (x - 1) / TILE, ty = (y - 1) / TILE;
+        int lx = x - tx * TILE, ly = y - ty * TILE;
+        return tile_prefix[size_t(ty) * (tw + 1) + tx] + row_prefix[(size_t(ty) * tw + tx) * L + ly]
+            + col_prefix[(size_t(tx) * th + ty) * L + lx] + tile(tx, ty)[ly * L + lx];
+    }
+
+    // Число ячеек состояния в прямоугольнике [x0, x1) × [y0, y1) (обрезается по сетке)
+    long long count(const std::vector<Cell>& cells, int x0, int y0, int x1, int y1) {
+        refresh(cells);
+        x0 = std::max(0, x0); y0 = std::max(0, y0); x1 = std::min(w, x1); y1 = std::min(h, y1);
+        if (x1 <= x0 || y1 <= y0) return 0;
+        return prefix(x1, y1) - prefix(x0, y1) - prefix(x1, y0) + prefix(x0, y0);
+    }
+};
+
 // Класс автомата Марголуса
 struct Margolus {
     int w, h;                // размеры сетки в ячейках
-    std::vector<int> cells;  // состояние ячеек (значения 0..3)
+    std::vector<Cell> cells; // состояние ячеек (значения 0..3)
     bool offset = false;     // смещение блока (чередуется каждый шаг)
     std::vector<Rule> rules; // набор правил
+    std::vector<Transition> table; // скомпилированная таблица переходов (пуста, если правила в неё не помещаются)
+    RuleMatcher matcher;           // граф решений для правил, не помещающихся в таблицу
+    int table_states = TABLE_STATES; // число состояний, на которое построена таблица
+    long long generation = 0;      // номер текущего поколения
+    int threads = default_threads(); // потоков для advance()
+    uint64_t busy_ns = 0;            // суммарное время работы потоков в последнем advance() (без ожидания соседей)
+    // Раскладка сетки на время advance(): 0 — построчно, 1 — фрагменты в Z-порядке, 2 — и ячейки внутри фрагментов
+    int layout = 0;
+    MortonGrid morton;
+
+    // Высота поверхности: для каждого столбца — y верхней непустой ячейки (h, если столбец пуст).
+    // Поддерживается инкрементально по изменившимся блокам, без полного пересканирования сетки.
+    std::vector<int> surface;
+    // Индексы (y0 * w + x0) левых верхних углов блоков, изменившихся на последнем шаге
+    std::vector<int> changed;
+    // Число ячеек каждого состояния; поддерживается по изменившимся блокам
+    std::vector<long long> population;
+
+    // Слой идентификаторов зёрен (необязательный): 0 — пустая ячейка.
+    // Старший бит идентификатора помечает зёрна, траектории которых записываются.
+    static const uint32_t TRACE_BIT = 0x80000000u;
+    bool track_ids = false;
+    std::vector<uint32_t> ids;
+    uint32_t next_id = 1;
+    std::unordered_map<uint32_t, int> trace_pos; // текущая позиция (y * w + x) отслеживаемых зёрен
+    std::vector<TracePoint> trajectories;
+
+    std::vector<FluxProbe> probes; // зонды потока
+    std::vector<AreaSums> area_sums; // таблицы сумм по площади для выбранных состояний
+
+    Margolus(int W, int H) : w(W), h(H), cells(W* H, 0), surface(W, H), population(TABLE_STATES, 0) {
+        population[0] = (long long)W * H;
+        set_rules(build_sand_rules());
+    }
+
+    void set_rules(const std::vector<Rule>& r) {
+        rules = r;
+        table.clear();
+        for (const auto& rule : rules)
+            for (int i = 0; i < 4; ++i) grow_population(std::max(rule.in[i], rule.out[i]));
+        int present = 0; // состояния, уже встречающиеся на сетке (например, вода после смены правил на песок)
+        for (size_t v = 0; v < population.size(); ++v)
+            if (population[v] > 0) present = int(v) + 1;
+        fit_table(present);
+    }
+
+    // Таблица строится на состояния правил и не меньше чем на states: индекс block_index не должен
+    // выходить за таблицу ни для одной ячейки сетки. Больше MAX_TABLE_STATES — сопоставитель без таблицы.
+    void fit_table(int states) {
+        int s = rules_table_states(rules);
+        table_states = s > 0 ? std::max(s, states) : 0;
+        if (table_states > MAX_TABLE_STATES) table_states = 0;
+        if (table_states > 0) table = compile_rules(rules, table_states);
+        else {
+            table.clear();
+            matcher.build(rules);
+        }
+    }
+
+    // Включение/выключение слоя идентификаторов; при включении каждое непустое зерно получает новый ID
+    void enable_ids(bool on) {
+        track_ids = on;
+        trace_pos.clear();
+        if (!on) { ids.clear(); ids.shrink_to_fit(); return; }
+        ids.assign(cells.size(), 0);
+        for (size_t i = 0; i < cells.size(); ++i)
+            if (cells[i] != 0) ids[i] = new_id();
+    }
+
+    uint32_t new_id() {
+        uint32_t id = next_id++;
+        if (next_id == TRACE_BIT) next_id = 1; // идентификаторы переиспользуются по кругу
+        return id;
+    }
+
+    // Начать запись траектории зерна в ячейке (x, y); возвращает его ID (0, если ячейка пуста)
+    uint32_t trace(int x, int y) {
+        if (!track_ids) return 0;
+        int i = y * w + x;
+        if (ids[i] == 0) return 0;
+        ids[i] |= TRACE_BIT;
+        trace_pos[ids[i] & ~TRACE_BIT] = i;
+        return ids[i] & ~TRACE_BIT;
+    }
+
+    // Регистрация зонда потока; возвращает его номер
+    int add_probe(bool horizontal, int pos, int from, int to) {
+        FluxProbe p;
+        p.horizontal = horizontal;
+        p.pos = horizontal ? (pos % h + h) % h : (pos % w + w) % w;
+        p.from = from; p.to = to;
+        p.series_first = generation;
+        probes.push_back(p);
+        return int(probes.size()) - 1;
+    }
+
+    // Учёт потока через зонды для изменившегося блока (по заранее вычисленным значениям записи таблицы)
+    void accumulate_flux(int x0, int y0, const Transition& t) {
+        int x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+        for (auto& p : probes) {
+            if (p.horizontal) {
+                if (p.pos != y1) continue;
+                if (x0 >= p.from && x0 < p.to) p.current += t.flux_down[0];
+                if (x1 >= p.from && x1 < p.to) p.current += t.flux_down[1];
+            }
+            else {
+                if (p.pos != x1) continue;
+                if (y0 >= p.from && y0 < p.to) p.current += t.flux_right[0];
+                if (y1 >= p.from && y1 < p.to) p.current += t.flux_right[1];
+            }
+        }
+    }
+
+    // Записать текущие позиции отслеживаемых зёрен
+    void sample_trajectories() {
+        for (const auto& kv : trace_pos)
+            trajectories.push_back(TracePoint{ generation, kv.first, kv.second % w, kv.second / w });
+    }
+
+    // Включение таблицы сумм по площади для состояния v (повторный вызов ничего не меняет)
+    void enable_area_sums(int v) {
+        for (const auto& a : area_sums)
+            if (a.state == v) return;
+        area_sums.emplace_back();
+        area_sums.back().reset(w, h, v);
+    }
+
+    // Число ячеек состояния v в прямоугольнике [x0, x1) × [y0, y1): за O(1) по таблице сумм,
+    // если она включена для v, иначе просмотром ячеек
+    long long count_in_rect(int v, int x0, int y0, int x1, int y1) {
+        for (auto& a : area_sums)
+            if (a.state == v) return a.count(cells, x0, y0, x1, y1);
+        x0 = std::max(0, x0); y0 = std::max(0, y0); x1 = std::min(w, x1); y1 = std::min(h, y1);
+        long long n = 0;
+        for (int y = y0; y < y1; ++y)
+            for (int x = x0; x < x1; ++x) n += cells[size_t(y) * w + x] == v;
+        return n;
+    }
+
+    // Пометка изменённого прямоугольника [x0, x1] × [y0, y1] для таблиц сумм
+    void touch_area(int x0, int y0, int x1, int y1) {
+        for (auto& a : area_sums) a.touch(x0, y0, x1, y1);
+    }
+
+    Cell& at(int x, int y) { x = (x % w + w) % w; y = (y % h + h) % h; return cells[y * w + x]; }
+
+    // Запись ячейки с обновлением высоты поверхности (для редактирования мышью)
+    void set(int x, int y, int v) {
+        x = (x % w + w) % w; y = (y % h + h) % h;
+        grow_population(v);
+        --population[cells[y * w + x]];
+        ++population[v];
+        cells[y * w + x] = Cell(v);
+        if (track_ids) {
+            if (ids[y * w + x] & TRACE_BIT) trace_pos.erase(ids[y * w + x] & ~TRACE_BIT);
+            ids[y * w + x] = v != 0 ? new_id() : 0;
+        }
+        for (auto& a : area_sums) a.touch(x, y);
+        update_surface(x, y);
+    }
+
+    // Заливка связной (по 4 соседям) области состояния клетки (x, y) значением v.
+    // Построчный алгоритм с явным стеком: в стек попадает по одной точке на каждый отрезок соседней строки.
+    // Край сетки ограничивает область (без зацикливания). Возвращает число изменённых ячеек,
+    // в box — затронутый прямоугольник {x0, y0, x1, y1} включительно.
+    long long flood_fill(int x, int y, int v, std::array<int, 4>& box) {
+        box = { x, y, x, y };
+        if (x < 0 || x >= w || y < 0 || y >= h) return 0;
+        int old = cells[y * w + x];
+        if (old == v) return 0;
+        grow_population(v);
+        long long n = 0;
+        std::vector<std::pair<int, int>> stack;
+        stack.push_back({ x, y });
+        while (!stack.empty()) {
+            int sx = stack.back().first, sy = stack.back().second;
+            stack.pop_back();
+            Cell* row = &cells[size_t(sy) * w];
+            if (row[sx] != old) continue;
+            int l = sx, r = sx;
+            while (l > 0 && row[l - 1] == old) --l;
+            while (r + 1 < w && row[r + 1] == old) ++r;
+            std::fill(row + l, row + r + 1, Cell(v));
+            n += r - l + 1;
+            if (track_ids)
+                for (int i = l; i <= r; ++i) {
+                    uint32_t& id = ids[size_t(sy) * w + i];
+                    if (id & TRACE_BIT) trace_pos.erase(id & ~TRACE_BIT);
+                    id = v != 0 ? new_id() : 0;
+                }
+            if (v != 0)
+                for (int i = l; i <= r; ++i) surface[i] = std::min(surface[i], sy);
+            box = { std::min(box[0], l), std::min(box[1], sy), std::max(box[2], r), std::max(box[3], sy) };
+            // начала отрезков старого состояния в соседних строках
+            for (int ny = sy - 1; ny <= sy + 1; ny += 2) {
+                if (ny < 0 || ny >= h) continue;
+                const Cell* nrow = &cells[size_t(ny) * w];
+                for (int i = l; i <= r; ++i) {
+                    if (nrow[i] != old) continue;
+                    stack.push_back({ i, ny });
+                    while (i <= r && nrow[i] == old) ++i;
+                }
+            }
+        }
+        population[old] -= n;
+        population[v] += n;
+        touch_area(box[0], box[1], box[2], box[3]);
+        // при очистке верхние ячейки столбцов могли опустеть
+        if (v == 0)
+            for (int i = box[0]; i <= box[2]; ++i)
+                if (surface[i] < h) update_surface(i, surface[i]);
+        return n;
+    }
+
+    // Копия прямоугольника [x0, x1] × [y0, y1] (включительно, в пределах сетки)
+    Region copy_region(int x0, int y0, int x1, int y1) const {
+        x0 = std::max(0, x0); y0 = std::max(0, y0); x1 = std::min(w - 1, x1); y1 = std::min(h - 1, y1);
+        if (x1 < x0 || y1 < y0) return Region();
+        Region r(x1 - x0 + 1, y1 - y0 + 1);
+        for (int y = y0; y <= y1; ++y)
+            std::copy(cells.begin() + size_t(y) * w + x0, cells.begin() + size_t(y) * w + x1 + 1, r.cells.begin() + size_t(y - y0) * r.w);
+        return r;
+    }
+
+    // Вставка фрагмента левым верхним углом в (x, y) построчным копированием; часть за краем сетки отбрасывается.
+    // Возвращает затронутый прямоугольник {x0, y0, x1, y1} (x1 < x0, если вставлять нечего).
+    std::array<int, 4> paste(const Region& r, int x, int y) {
+        int x0 = std::max(0, x), y0 = std::max(0, y);
+        int x1 = std::min(w - 1, x + r.w - 1), y1 = std::min(h - 1, y + r.h - 1);
+        if (x1 < x0 || y1 < y0) return { 0, 0, -1, -1 };
+        for (int yy = y0; yy <= y1; ++yy) {
+            Cell* row = &cells[size_t(yy) * w + x0];
+            const Cell* src = &r.cells[size_t(yy - y) * r.w + (x0 - x)];
+            for (int i = 0; i <= x1 - x0; ++i) {
+                grow_population(src[i]);
+                --population[row[i]];
+                ++population[src[i]];
+            }
+            std::memcpy(row, src, size_t(x1 - x0 + 1));
+            if (track_ids)
+                for (int i = 0; i <= x1 - x0; ++i) {
+                    uint32_t& id = ids[size_t(yy) * w + x0 + i];
+                    if (id & TRACE_BIT) trace_pos.erase(id & ~TRACE_BIT);
+                    id = row[i] != 0 ? new_id() : 0;
+                }
+        }
+        // выше min(surface, y0) столбец не менялся и пуст — пересчёт с этой строки
+        for (int xx = x0; xx <= x1; ++xx) {
+            int& top = surface[xx];
+            top = std::min(top, y0);
+            while (top < h && cells[size_t(top) * w + xx] == 0) ++top;
+        }
+        touch_area(x0, y0, x1, y1);
+        return { x0, y0, x1, y1 };
+    }
+
+    int surface_height(int x) const { return surface[x]; }
+
+    // Коррекция высоты столбца x после изменения ячейки (x, y)
+    void update_surface(int x, int y) {
+        int& top = surface[x];
+        if (cells[y * w + x] != 0) {
+            if (y < top) top = y;
+        }
+        else if (y == top) {
+            // верхняя ячейка опустела — ищем следующую непустую ниже
+            while (top < h && cells[top * w + x] == 0) ++top;
+        }
+    }
+
+    // Объём памяти, занятой данными автомата (байты)
+    size_t memory_bytes() const {
+        size_t b = sizeof(*this) + cells.capacity() * sizeof(Cell) + surface.capacity() * sizeof(int)
+            + changed.capacity() * sizeof(int) + ids.capacity() * sizeof(uint32_t)
+            + table.capacity() * sizeof(Transition) + rules.capacity() * sizeof(Rule)
+            + matcher.variants.capacity() * sizeof(RuleMatcher::Variant) + matcher.nodes.capacity() * sizeof(RuleMatcher::Node)
+            + matcher.edges.capacity() * sizeof(int)
+            + trace_pos.size() * (sizeof(uint32_t) + sizeof(int) + 2 * sizeof(void*))
+            + trajectories.capacity() * sizeof(TracePoint) + morton.data.capacity() + morton.slot.capacity() * sizeof(uint32_t);
+        for (const auto& p : probes) b += p.series.capacity() * sizeof(int);
+        for (const auto& a : area_sums)
+            b += a.local.capacity() * sizeof(uint16_t) + (a.row_prefix.capacity() + a.col_prefix.capacity()) * sizeof(int)
+                + a.tile_prefix.capacity() * sizeof(long long) + a.dirty.capacity();
+        return b;
+    }
+
+    // Загрузка состояния из другого автомата того же размера (например, общий старт для сравнения A/B)
+    void copy_state(const Margolus& o) {
+        cells = o.cells;
+        offset = o.offset;
+        generation = o.generation;
+        rebuild_stats();
+        if (track_ids) enable_ids(true);
+    }
+
+    // Вызывается перед каждой записью состояния v в сетку: численность и таблица переходов расширяются под v
+    void grow_population(int v) {
+        if (v >= int(population.size())) population.resize(size_t(v) + 1, 0);
+        if (v >= table_states && !table.empty()) fit_table(v + 1);
+    }
+
+    // Полный пересчёт производных данных: высот и численности состояний
+    void rebuild_stats() {
+        rebuild_surface();
+        for (auto& a : area_sums) a.touch_all();
+        std::fill(population.begin(), population.end(), 0);
+        for (int v : cells) {
+            grow_population(v);
+            ++population[v];
+        }
+    }
+
+    // Полный пересчёт высот: просмотр сверху вниз до тех пор, пока у всех столбцов не найдена поверхность
+    void rebuild_surface() {
+        std::fill(surface.begin(), surface.end(), h);
+        int missing = w;
+        for (int y = 0; y < h && missing > 0; ++y) {
+            const Cell* row = &cells[size_t(y) * w];
+            for (int x = 0; x < w; ++x)
+                if (row[x] != 0 && surface[x] == h) { surface[x] = y; --missing; }
+        }
+    }
+
+    // Один шаг автомата
+    void step() {
+        std::vector<Cell> next = cells; // начнем с текущих значений
+        changed.clear();
+
+        int ox = offset ? 1 : 0;
+        int oy = offset ? 1 : 0; // диагональное смещение (1,1), когда offset == true
+
+        for (int by = oy; by < h + oy; by += 2) {
+            for (int bx = ox; bx < w + ox; bx += 2) {
+                // координаты левого верхнего угла блока (с учетом зацикливания)
+                int x0 = (bx) % w;
+                int y0 = (by) % h;
+                Block b{ at(x0,y0), at(x0 + 1,y0), at(x0,y0 + 1), at(x0 + 1,y0 + 1) };
+
+                Block out = b;
+                const Transition* t = nullptr;
+                Transition generic;
+                if (!table.empty()) {
+                    t = &table[block_index(b, table_states)];
+                    if (!t->changes) continue;
+                    out = t->out;
+                }
+                // если ни одно правило не подошло — блок остаётся без изменений
+                else if (!matcher.match(b, out) || out == b) continue;
+                else if (track_ids || !probes.empty()) t = &(generic = make_transition(b, out));
+
+                next[y0 * w + x0] = out[0];
+                next[y0 * w + ((x0 + 1) % w)] = out[1];
+                next[((y0 + 1) % h) * w + x0] = out[2];
+                next[((y0 + 1) % h) * w + ((x0 + 1) % w)] = out[3];
+                changed.push_back(y0 * w + x0);
+                for (int i = 0; i < 4; ++i)
+                    if (out[i] != b[i]) { --population[b[i]]; ++population[out[i]]; }
+                if (track_ids) permute_ids(x0, y0, out, *t);
+                if (!probes.empty() && t->has_flux) accumulate_flux(x0, y0, *t);
+            }
+        }
+
+        cells.swap(next);
+        offset = !offset;
+        ++generation;
+        if (table.empty()) matcher.end_step();
+
+        for (auto& p : probes) {
+            p.total += p.current;
+            p.series.push_back(p.current);
+            p.current = 0;
+            if (p.series.size() >= 2 * FluxProbe::SERIES_MAX) { // отбрасываем старую половину
+                p.series.erase(p.series.begin(), p.series.begin() + FluxProbe::SERIES_MAX);
+                p.series_first += FluxProbe::SERIES_MAX;
+            }
+        }
+
+        // высоты меняются только в столбцах изменившихся блоков
+        for (int idx : changed) {
+            int x0 = idx % w, y0 = idx / w;
+            int x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+            update_surface(x0, y0); update_surface(x0, y1);
+            update_surface(x1, y0); update_surface(x1, y1);
+            for (auto& a : area_sums) {
+                a.touch(x0, y0); a.touch(x1, y0);
+                a.touch(x0, y1); a.touch(x1, y1);
+            }
+        }
+    }
+
+    // Несколько поколений подряд. С таблицей переходов (без слоя ids и зондов) сетка делится на полосы строк,
+    // и поколения проходят по полосам волновым фронтом: полоса начинает поколение g, как только она и обе
+    // соседние закончили g - 1 (счётчик done у каждой полосы), — общего барьера между фазами нет.
+    // Блоки одной фазы не пересекаются, поэтому полосы обновляются на месте; результат совпадает с n вызовами step().
+    // changed после вызова — блоки последнего поколения; высоты и суммы обновляются по группам 2×2, отмеченным
+    // за всю пачку (у каждой полосы своя карта отметок, поэтому память не растёт с длиной пачки).
+    void advance(long long n) {
+        if (layout != 0 && n >= MORTON_MIN_BATCH && !table.empty() && !track_ids && probes.empty()) {
+            advance_morton(n);
+            return;
+        }
+        int bands = std::min(h / 2, std::max(1, threads) * 4);
+        int nthreads = std::min(threads, bands);
+        if (n < 2 || nthreads < 2 || bands < 3 || table.empty() || track_ids || !probes.empty()) {
+            const auto t0 = std::chrono::steady_clock::now();
+            for (long long g = 0; g < n; ++g) step();
+            busy_ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count());
+            return;
+        }
+        struct Band {
+            std::vector<uint8_t> touched;     // группы 2×2 полосы (и строки групп под ней), менявшиеся в пачке
+            std::vector<int> last;            // изменившиеся блоки последнего поколения
+            std::vector<long long> delta;     // изменение population
+        };
+        std::vector<Band> band(bands);
+        std::vector<int> bound(size_t(bands) + 1);
+        for (int b = 0; b <= bands; ++b) bound[b] = 2 * int((long long)(h / 2) * b / bands);
+        const int gw = w / 2; // групп 2×2 (выровненных по чётным координатам) в строке
+        for (int b = 0; b < bands; ++b) {
+            band[b].delta.assign(population.size(), 0);
+            band[b].touched.assign(size_t((bound[b + 1] - bound[b]) / 2 + 1) * gw, 0);
+        }
+        const bool start_offset = offset;
+
+        // Поколение g (от начала пачки) в полосе b: блоки с верхней строкой в [bound[b], bound[b + 1]) + смещение
+        auto run_band = [&](int b, long long g) {
+            Band& B = band[size_t(b)];
+            int o = start_offset != ((g & 1) != 0) ? 1 : 0;
+            for (int by = bound[b] + o; by < bound[b + 1] + o; by += 2) {
+                int y0 = by % h;
+                Cell* r0 = &cells[size_t(y0) * w];
+                Cell* r1 = &cells[size_t((y0 + 1) % h) * w];
+                for (int bx = o; bx < w + o; bx += 2) {
+                    int x0 = bx % w, x1 = (x0 + 1) % w;
+                    Block in{ r0[x0], r0[x1], r1[x0], r1[x1] };
+                    const Transition& t = table[block_index(in, table_states)];
+                    if (!t.changes) continue;
+                    r0[x0] = t.out[0]; r0[x1] = t.out[1];
+                    r1[x0] = t.out[2]; r1[x1] = t.out[3];
+                    for (int i = 0; i < 4; ++i)
+                        if (t.out[i] != in[i]) { --B.delta[in[i]]; ++B.delta[t.out[i]]; }
+                    // строки групп от начала полосы по незавёрнутым by, by + 1 (лишняя строка — для нечётной фазы)
+                    int ry0 = (by - bound[b]) / 2, ry1 = (by + 1 - bound[b]) / 2;
+                    B.touched[size_t(ry0) * gw + x0 / 2] = 1; B.touched[size_t(ry0) * gw + x1 / 2] = 1;
+                    B.touched[size_t(ry1) * gw + x0 / 2] = 1; B.touched[size_t(ry1) * gw + x1 / 2] = 1;
+                    if (g == n - 1) B.last.push_back(y0 * w + x0);
+                }
+            }
+        };
+        busy_ns = wavefront(bands, nthreads, n, run_band);
+
+        changed.clear();
+        for (const auto& B : band) {
+            changed.insert(changed.end(), B.last.begin(), B.last.end());
+            for (size_t v = 0; v < population.size(); ++v) population[v] += B.delta[v];
+        }
+        // по итоговой сетке: update_surface не зависит от порядка и промежуточных состояний
+        for (int b = 0; b < bands; ++b) {
+            const auto& tb = band[b].touched;
+            for (size_t i = 0; i < tb.size(); ++i) {
+                if (!tb[i]) continue;
+                int x0 = int(i % gw) * 2, y0 = (bound[b] + int(i / gw) * 2) % h;
+                update_surface(x0, y0); update_surface(x0, y0 + 1);
+                update_surface(x0 + 1, y0); update_surface(x0 + 1, y0 + 1);
+                for (auto& a : area_sums) {
+                    a.touch(x0, y0); a.touch(x0 + 1, y0);
+                    a.touch(x0, y0 + 1); a.touch(x0 + 1, y0 + 1);
+                }
+            }
+        }
+        offset = start_offset != ((n & 1) != 0);
+        generation += n;
+    }
+
+    // Пачка поколений в раскладке MortonGrid: сетка переносится туда и обратно один раз за пачку, поэтому
+    // раскладка включается только для пачек от MORTON_MIN_BATCH шагов (консольный режим). Полосы волнового
+    // фронта — строки фрагментов 64×64; высоты пересчитываются по итоговой сетке.
+    // Порядок блоков внутри фазы не важен — результат тот же, что у step().
+    static const long long MORTON_MIN_BATCH = 32;
+    void advance_morton(long long n) {
+        if (morton.w != w || morton.h != h || morton.inner_morton != (layout == 2)) morton.init(w, h, layout == 2);
+        const int bands = morton.ch;
+        parallel_for(bands, threads, [&](int cy, int) { morton.load(cells, cy); });
+        std::vector<std::vector<long long>> delta(size_t(bands), std::vector<long long>(population.size(), 0));
+        std::vector<std::vector<int>> last(static_cast<size_t>(bands)); // изменившиеся блоки последнего поколения
+        const bool start_offset = offset;
+        busy_ns = wavefront(bands, threads, n, [&](int b, long long g) {
+            last[size_t(b)].clear();
+            morton.step(table, table_states, start_offset != ((g & 1) != 0), b, delta[size_t(b)], last[size_t(b)]);
+        });
+        parallel_for(bands, threads, [&](int cy, int) { morton.store(cells, cy); });
+        changed.clear();
+        for (int b = 0; b < bands; ++b) {
+            changed.insert(changed.end(), last[size_t(b)].begin(), last[size_t(b)].end());
+            for (size_t v = 0; v < population.size(); ++v) population[v] += delta[size_t(b)][v];
+        }
+        offset = start_offset != ((n & 1) != 0);
+        rebuild_surface();
+        for (auto& a : area_sums) a.touch_all();
+        generation += n;
+    }
+
+    // Перенос идентификаторов зёрен вместе с перестановкой ячеек блока.
+    // Блоки одного шага не пересекаются, поэтому ids обновляется на месте.
+    void permute_ids(int x0, int y0, const Block& out, const Transition& t) {
+        int x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+        int pos[4] = { y0 * w + x0, y0 * w + x1, y1 * w + x0, y1 * w + x1 };
+        const std::array<signed char, 4>& src = t.src;
+        uint32_t old_ids[4] = { ids[pos[0]], ids[pos[1]], ids[pos[2]], ids[pos[3]] };
+        for (int i = 0; i < 4; ++i) {
+            uint32_t id = src[i] >= 0 ? old_ids[src[i]] : (out[i] != 0 ? new_id() : 0);
+            ids[pos[i]] = id;
+            if (id & TRACE_BIT) trace_pos[id & ~TRACE_BIT] = pos[i];
+        }
+        // зёрна, исчезнувшие из блока, перестают отслеживаться
+        for (int j = 0; j < 4; ++j) {
+            if (!(old_ids[j] & TRACE_BIT)) continue;
+            bool kept = false;
+            for (int i = 0; i < 4; ++i) kept |= src[i] == j;
+            if (!kept) trace_pos.erase(old_ids[j] & ~TRACE_BIT);
+        }
+    }
+
+    // Очистка: memset по байтовой сетке, статистика задаётся сразу
+    void clear() {
+        std::memset(cells.data(), 0, cells.size());
+        std::fill(surface.begin(), surface.end(), h);
+        std::fill(population.begin(), population.end(), 0);
+        population[0] = (long long)cells.size();
+        for (auto& a : area_sums) a.touch_all();
+        if (track_ids) enable_ids(true);
+    }
+
+    // Заполнение песком с вероятностью fill_prob из 64-битных слов счётчикового генератора (seed, номер слова).
+    // Вероятность приводится к виду k/2^m (m <= 16; двоично-рациональные — точно), и 64 ячейки получаются
+    // побитовым сравнением m-битных случайных чисел с k: старшие биты берутся из первых слов, и как только
+    // все 64 сравнения решены, остальные слова не нужны. Результат зависит только от seed,
+    // участки сетки заполняются параллельно.
+    void randomize(double fill_prob = 0.12, uint64_t seed = 12345, int threads = default_threads()) {
+        // байт i значения spread[b] равен биту i числа b
+        static const std::array<uint64_t, 256> spread = [] {
+            std::array<uint64_t, 256> t{};
+            for (int b = 0; b < 256; ++b)
+                for (int i = 0; i < 8; ++i) t[b] |= uint64_t((b >> i) & 1) << (8 * i);
+            return t;
+        }();
+        if (fill_prob <= 0.0) { clear(); return; }
+        fill_prob = std::min(1.0, fill_prob);
+        int m = 16;
+        for (int mm = 1; mm < 16; ++mm) {
+            double kk = fill_prob * double(1 << mm);
+            if (kk == std::floor(kk)) { m = mm; break; }
+        }
+        const uint64_t k = uint64_t(std::llround(fill_prob * double(1 << m)));
+        const size_t n = cells.size(), CHUNK = size_t(1) << 16;
+        const int chunks = int((n + CHUNK - 1) / CHUNK);
+        std::vector<long long> sand(size_t(chunks), 0);
+        parallel_for(chunks, threads, [&](int c, int) {
+            size_t begin = size_t(c) * CHUNK, end = std::min(n, begin + CHUNK);
+            Cell* out = cells.data();
+            long long cnt = 0;
+            for (size_t i = begin; i < end; i += 64) {
+                uint64_t lt = 0, eq = ~0ull, word = i / 64 * uint64_t(m);
+                if (k >> m) lt = ~0ull; // fill_prob == 1
+                else
+                    for (int j = m - 1; j >= 0 && eq; --j) {
+                        uint64_t r = mix64(seed ^ (0x9e3779b97f4a7c15ull * (word + uint64_t(m - 1 - j) + 1)));
+                        if ((k >> j) & 1) { lt |= eq & ~r; eq &= r; }
+                        else eq &= ~r;
+                    }
+                if (end - i < 64) lt &= (1ull << (end - i)) - 1;
+                cnt += popcount64(lt);
+                for (size_t b = 0; b < 64 && i + b < end; b += 8) {
+                    uint64_t bytes = spread[(lt >> b) & 0xff];
+                    if (i + b + 8 <= end) std::memcpy(out + i + b, &bytes, 8);
+                    else for (size_t q = 0; i + b + q < end; ++q) out[i + b + q] = Cell((bytes >> (8 * q)) & 1);
+                }
+            }
+            sand[size_t(c)] = cnt;
+        });
+        std::fill(population.begin(), population.end(), 0);
+        for (long long c : sand) population[1] += c;
+        population[0] = (long long)n - population[1];
+        rebuild_surface();
+        for (auto& a : area_sums) a.touch_all();
+        if (track_ids) enable_ids(true);
+    }
+};
+
+inline float smooth01(float t) { return t * t * (3.f - 2.f * t); }
+
+// Параметры генератора мира
+struct WorldGenParams {
+    uint64_t seed = 1;
+    double terrain_height = 0.35; // средняя высота рельефа (доля высоты сетки)
+    double terrain_rough = 0.25;  // размах рельефа (доля высоты сетки)
+    int terrain_scale = 96;       // масштаб холмов (ячеек)
+    int cave_scale = 32;          // масштаб пещер (ячеек)
+    double cave_level = 0.62;     // порог шума, выше которого грунт вырезается
+    int octaves = 3;
+    int sand_layers = 3;          // число пластов песка в верхней части грунта
+    int layer_thickness = 5;
+    int sources = 4;              // источников над рельефом
+};
+
+// Октавы шума значений по одной оси: индекс узла решётки и сглаженный вес для каждой координаты
+struct NoiseAxis {
+    int spacing = 1;
+    std::vector<int> cell;
+    std::vector<float> t;
+
+    NoiseAxis(int n, int s) : spacing(std::max(2, s)), cell(n), t(n) {
+        for (int i = 0; i < n; ++i) { cell[i] = i / spacing; t[i] = smooth01(float(i % spacing) / spacing); }
+    }
+};
+
+// Процедурная генерация мира: рельеф из грунта по шуму значений, пещеры, пласты песка и источники.
+// Строки заполняются блоками параллельно; высоты столбцов и численность состояний собираются по блокам.
+void generate_world(Margolus& sim, const WorldGenParams& p, int threads) {
+    const int w = sim.w, h = sim.h;
+    // высота рельефа по столбцам (одномерный фрактальный шум)
+    std::vector<int> ground(w);
+    parallel_for((w + 1023) / 1024, threads, [&](int c, int) {
+        for (int x = c * 1024; x < std::min(w, c * 1024 + 1024); ++x) {
+            float n = 0.f, amp = 0.5f;
+            for (int o = 0, s = p.terrain_scale; o < p.octaves; ++o, s = std::max(2, s / 2), amp *= 0.5f) {
+                int i = x / s;
+                float t = smooth01(float(x % s) / s);
+                float a = counter_uniform(p.seed, 1 + o, uint32_t(i), 0), b = counter_uniform(p.seed, 1 + o, uint32_t(i + 1), 0);
+                n += amp * (a + (b - a) * t);
+            }
+            ground[x] = int(h * (1.0 - p.terrain_height - p.terrain_rough * (n - 0.4375) * 2.0));
+            ground[x] = std::max(1, std::min(h, ground[x]));
+        }
+    });
+
+    // оси шума пещер для всех октав
+    std::vector<NoiseAxis> ax, ay;
+    for (int o = 0, s = p.cave_scale; o < p.octaves; ++o, s /= 2) { ax.emplace_back(w, s); ay.emplace_back(h, s); }
+
+    const int ROWS = 64;
+    int chunks = (h + ROWS - 1) / ROWS;
+    int nthreads = std::max(1, std::min(threads, chunks));
+    // размер — как у population, выращенного set_rules (с материалами — больше 4 состояний)
+    const size_t states = std::max<size_t>(sim.population.size(), 4);
+    std::vector<std::vector<long long>> pop(nthreads, std::vector<long long>(states, 0));
+    std::vector<std::vector<int>> top(nthreads, std::vector<int>(w, h));
+    parallel_for(chunks, nthreads, [&](int c, int t) {
+        std::vector<float> noise(w), lattice;
+        for (int y = c * ROWS; y < std::min(h, c * ROWS + ROWS); ++y) {
+            // шум пещер для строки: сначала интерполяция узлов по y, затем по x
+            std::fill(noise.begin(), noise.end(), 0.f);
+            float amp = 0.5f;
+            for (int o = 0; o < p.octaves; ++o, amp *= 0.5f) {
+                int j = ay[o].cell[y];
+                float ty = ay[o].t[y];
+                int nx = w / ax[o].spacing + 2;
+                lattice.resize(nx);
+                for (int i = 0; i < nx; ++i) {
+                    float a = counter_uniform(p.seed, 100 + o, uint32_t(i), uint32_t(j));
+                    float b = counter_uniform(p.seed, 100 + o, uint32_t(i), uint32_t(j + 1));
+                    lattice[i] = a + (b - a) * ty;
+                }
+                const int* cx = ax[o].cell.data();
+                const float* tx = ax[o].t.data();
+                for (int x = 0; x < w; ++x) {
+                    float a = lattice[cx[x]], b = lattice[cx[x] + 1];
+                    noise[x] += amp * (a + (b - a) * tx[x]);
+                }
+            }
+            float norm = 1.f / (1.f - std::pow(0.5f, float(p.octaves)));
+            Cell* row = &sim.cells[size_t(y) * w];
+            for (int x = 0; x < w; ++x) {
+                int v = 0;
+                int depth = y - ground[x];
+                if (depth >= 0) {
+                    v = 2;
+                    if (noise[x] * norm > p.cave_level && depth > 2) v = 0;           // пещера
+                    else if (depth / p.layer_thickness % 2 == 1 && depth / p.layer_thickness < 2 * p.sand_layers) v = 1; // пласт песка
+                }
+                row[x] = Cell(v);
+                ++pop[t][v];
+                if (v != 0 && y < top[t][x]) top[t][x] = y;
+            }
+        }
+    });
+
+    // источники над рельефом (положение зависит только от seed)
+    for (int i = 0; i < p.sources; ++i) {
+        int x = int(counter_random(p.seed, 200, uint32_t(i), 0) % uint64_t(w));
+        int y = std::max(0, std::min(ground[x] - 8, int(counter_random(p.seed, 201, uint32_t(i), 0) % uint64_t(std::max(1, h / 8)))));
+        --pop[0][sim.cells[size_t(y) * w + x]];
+        sim.cells[size_t(y) * w + x] = 3;
+        ++pop[0][3];
+        top[0][x] = std::min(top[0][x], y);
+    }
+
+    sim.population.assign(states, 0);
+    std::fill(sim.surface.begin(), sim.surface.end(), h);
+    for (int t = 0; t < nthreads; ++t) {
+        for (size_t v = 0; v < states; ++v) sim.population[v] += pop[t][v];
+        for (int x = 0; x < w; ++x) sim.surface[x] = std::min(sim.surface[x], top[t][x]);
+    }
+    sim.offset = false;
+    sim.generation = 0;
+    for (auto& a : sim.area_sums) a.touch_all();
+    if (sim.track_ids) sim.enable_ids(true);
+}
+
+// Команда редактирования: общий путь для правок мышью, заливки и вставки фрагментов, а также
+// общих операций над полем (очистка, случайное заполнение, мир, смена правил) — в том числе по сети
+struct EditCommand {
+    enum Type : uint8_t { Paint, Fill, Paste, Clear, Randomize, World, Rules };
+    Type type = Paint;
+    int x = 0, y = 0, state = 0; // Randomize: state — заполнение в тысячных; World: x — seed; Rules: state — номер набора
+    std::shared_ptr<const Region> region; // для Paste
+};
+
+// Применение команды; возвращает затронутый прямоугольник {x0, y0, x1, y1} включительно
+std::array<int, 4> apply_edit(Margolus& sim, const EditCommand& c) {
+    std::array<int, 4> box{ c.x, c.y, c.x, c.y };
+    if (c.type == EditCommand::Paint) sim.set(c.x, c.y, c.state);
+    else if (c.type == EditCommand::Fill) sim.flood_fill(c.x, c.y, c.state, box);
+    else if (c.type == EditCommand::Paste) { if (c.region) box = sim.paste(*c.region, c.x, c.y); }
+    else if (c.type == EditCommand::Rules) { sim.set_rules(rule_set(c.state)); box = { sim.w, sim.h, -1, -1 }; }
+    else {
+        if (c.type == EditCommand::Clear) sim.clear();
+        else if (c.type == EditCommand::Randomize) sim.randomize(c.state / 1000.0);
+        else {
+            WorldGenParams gp;
+            gp.seed = uint64_t(uint32_t(c.x));
+            generate_world(sim, gp, default_threads());
+        }
+        box = { 0, 0, sim.w - 1, sim.h - 1 };
+    }
+    return box;
+}
+
+// Проверка команды, пришедшей по сети, до применения: состояния меньше states, координаты и фрагмент
+// в пределах поля, номер набора правил и доля заполнения допустимы
+bool valid_edit(const Margolus& sim, const EditCommand& c, int states) {
+    switch (c.type) {
+    case EditCommand::Paint:
+    case EditCommand::Fill:
+        return c.state >= 0 && c.state < states && c.x >= 0 && c.x < sim.w && c.y >= 0 && c.y < sim.h;
+    case EditCommand::Paste: {
+        if (!c.region) return false;
+        const Region& r = *c.region;
+        if (r.w > sim.w || r.h > sim.h || c.x <= -r.w || c.x >= sim.w || c.y <= -r.h || c.y >= sim.h) return false;
+        for (Cell v : r.cells)
+            if (v >= states) return false;
+        return true;
+    }
+    case EditCommand::Randomize: return c.state >= 0 && c.state <= 1000;
+    case EditCommand::Rules: return c.state >= 0 && c.state < RULE_SETS;
+    default: return true;
+    }
+}
+
+// Гистограмма с логарифмическими корзинами: корзина k содержит значения [2^k, 2^(k+1))
+struct LogHistogram {
+    std::array<long long, 64> bins{};
+    long long count = 0, max = 0;
+    double sum = 0;
+
+    void add(long long v) {
+        if (v < 1) return;
+        int k = 0;
+        while (k < 62 && (v >> (k + 1)) != 0) ++k;
+        ++bins[k];
+        ++count;
+        sum += double(v);
+        max = std::max(max, v);
+    }
+
+    int top_bin() const {
+        int k = 63;
+        while (k > 0 && bins[k] == 0) --k;
+        return k;
+    }
+};
+
+// Статистика лавин: после возмущения автомат шагает до затишья (два пустых шага подряд — по одному на
+// каждую фазу разбиения), а размер, длительность и площадь эпизода берутся из списка изменившихся блоков.
+// Размер — суммарное число изменившихся блоков, длительность — номер последнего активного шага,
+// площадь — число различных ячеек, попавших в изменившиеся блоки.
+struct AvalancheAnalyzer {
+    struct Episode {
+        long long size = 0, duration = 0, area = 0;
+        bool truncated = false; // активность не затихла за max_steps шагов
+    };
+
+    LogHistogram size, duration, area;
+    long long events = 0;    // число возмущений
+    long long silent = 0;    // возмущений без лавины (зерно сразу легло)
+    long long truncated = 0;
+    long long max_steps = 1 << 20;
+    std::vector<uint32_t> mark; // номер эпизода, в котором ячейка уже учтена в площади
+    uint32_t epoch = 0;
+
+    // Шаги до затишья с учётом активности
+    Episode relax(Margolus& sim) {
+        Episode e;
+        if (mark.size() != sim.cells.size()) { mark.assign(sim.cells.size(), 0); epoch = 0; }
+        if (++epoch == 0) { std::fill(mark.begin(), mark.end(), 0); epoch = 1; }
+        int idle = 0;
+        for (long long t = 1; idle < 2; ++t) {
+            if (t > max_steps) { e.truncated = true; break; }
+            sim.step();
+            if (sim.changed.empty()) { ++idle; continue; }
+            idle = 0;
+            e.duration = t;
+            e.size += (long long)sim.changed.size();
+            for (int idx : sim.changed) {
+                int x0 = idx % sim.w, y0 = idx / sim.w;
+                int x1 = (x0 + 1) % sim.w, y1 = (y0 + 1) % sim.h;
+                size_t c[4] = { size_t(y0) * sim.w + x0, size_t(y0) * sim.w + x1, size_t(y1) * sim.w + x0, size_t(y1) * sim.w + x1 };
+                for (size_t i : c)
+                    if (mark[i] != epoch) { mark[i] = epoch; ++e.area; }
+            }
+        }
+        return e;
+    }
+
+    // Одно возмущение: зерно state кладётся на поверхность столбца x. Возвращает false, если столбец заполнен.
+    bool perturb(Margolus& sim, int x, Episode& e, int state = 1) {
+        int y = sim.surface_height(x) - 1;
+        if (y < 0) return false;
+        sim.set(x, y, state);
+        e = relax(sim);
+        ++events;
+        if (e.truncated) ++truncated;
+        if (e.size == 0) { ++silent; return true; }
+        size.add(e.size);
+        duration.add(e.duration);
+        area.add(e.area);
+        return true;
+    }
+};
+
+// Трёхмерный автомат Марголуса: блоки 2×2×2, смещение (1,1,1) чередуется каждый шаг.
+// Ось y направлена вниз (гравитация), как и в двумерном автомате.
+
+// Порядок ячеек блока: индекс = x + 2*z + 4*y, т.е. 0..3 — верхний слой, 4..7 — нижний
+using Block3 = std::array<int, 8>;
+
+// Группа симметрий правила относительно вертикальной оси
+enum class Symmetry3 : uint8_t {
+    None,     // только само правило
+    Mirror,   // плюс отражение по x
+    Rotate,   // повороты на 90°, 180°, 270° вокруг вертикали
+    Full      // повороты и отражения (группа квадрата)
+};
+
+// Правило 3D: шаблоны входа и выхода (-1 — «любое значение» / «скопировать вход») и группа симметрий
+struct Rule3 {
+    Block3 in;
+    Block3 out;
+    Symmetry3 symmetry = Symmetry3::None;
+};
+
+// Перестановка ячеек блока при преобразовании горизонтального слоя 2×2 (одинаково для обоих слоёв)
+Block3 transform_block3(const Block3& b, int rotations, bool mirror) {
+    Block3 r = b;
+    for (int i = 0; i < 8; ++i) {
+        int x = i & 1, z = (i >> 1) & 1, y = i >> 2;
+        for (int k = 0; k < rotations; ++k) { int nx = 1 - z; z = x; x = nx; }
+        if (mirror) x = 1 - x;
+        r[x + 2 * z + 4 * y] = b[i];
+    }
+    return r;
+}
+
+// Все различные варианты правила из его группы симметрий; исходное правило — первое
+std::vector<Rule3> expand_rule3(const Rule3& r) {
+    int rots = (r.symmetry == Symmetry3::Rotate || r.symmetry == Symmetry3::Full) ? 4 : 1;
+    int mirrors = (r.symmetry == Symmetry3::Mirror || r.symmetry == Symmetry3::Full) ? 2 : 1;
+    std::vector<Rule3> v;
+    for (int m = 0; m < mirrors; ++m)
+        for (int k = 0; k < rots; ++k) {
+            Rule3 t{ transform_block3(r.in, k, m == 1), transform_block3(r.out, k, m == 1), Symmetry3::None };
+            bool dup = false;
+            for (const auto& e : v) dup |= e.in == t.in && e.out == t.out;
+            if (!dup) v.push_back(t);
+        }
+    return v;
+}
+
+// Песок в 3D: падают сразу все столбцы блока, под которыми пусто (сначала большие наборы),
+// затем осыпание на соседний или диагональный столбец, затем источник
+std::vector<Rule3> build_sand_rules_3d() {
+    const int _ = -1;
+    std::vector<Rule3> rules;
+    // падение: верх 1 над пустым низом — для 4, 3, 2 соседних, 2 диагональных и 1 столбца
+    rules.push_back(Rule3{ Block3{ 1,1,1,1, 0,0,0,0 }, Block3{ 0,0,0,0, 1,1,1,1 }, Symmetry3::None });
+    rules.push_back(Rule3{ Block3{ 1,1,1,_, 0,0,0,_ }, Block3{ 0,0,0,_, 1,1,1,_ }, Symmetry3::Rotate });
+    rules.push_back(Rule3{ Block3{ 1,1,_,_, 0,0,_,_ }, Block3{ 0,0,_,_, 1,1,_,_ }, Symmetry3::Rotate });
+    rules.push_back(Rule3{ Block3{ 1,_,_,1, 0,_,_,0 }, Block3{ 0,_,_,0, 1,_,_,1 }, Symmetry3::Rotate });
+    rules.push_back(Rule3{ Block3{ 1,_,_,_, 0,_,_,_ }, Block3{ 0,_,_,_, 1,_,_,_ }, Symmetry3::Rotate });
+    // осыпание: зерно на опоре уходит вниз в свободный соседний (затем диагональный) столбец
+    rules.push_back(Rule3{ Block3{ 1,0,_,_, _,0,_,_ }, Block3{ 0,0,_,_, _,1,_,_ }, Symmetry3::Full });
+    rules.push_back(Rule3{ Block3{ 1,_,_,0, _,_,_,0 }, Block3{ 0,_,_,0, _,_,_,1 }, Symmetry3::Rotate });
+    // источник порождает песок под собой
+    rules.push_back(Rule3{ Block3{ 3,_,_,_, 0,_,_,_ }, Block3{ 3,_,_,_, 1,_,_,_ }, Symmetry3::Rotate });
+    return rules;
+}
+
+// Компиляция правил 3D в таблицу на 4^8 = 65536 блоков: вход и выход упакованы по 2 бита на ячейку
+std::vector<uint16_t> compile_rules3(const std::vector<Rule3>& rules) {
+    std::vector<std::vector<Rule3>> variants;
+    for (const auto& r : rules) variants.push_back(expand_rule3(r));
+    std::vector<uint16_t> table(1 << 16);
+    for (int idx = 0; idx < (1 << 16); ++idx) {
+        Block3 b;
+        for (int i = 0; i < 8; ++i) b[i] = (idx >> (2 * i)) & 3;
+        table[idx] = uint16_t(idx);
+        bool done = false;
+        for (size_t r = 0; r < variants.size() && !done; ++r)
+            for (const auto& v : variants[r]) {
+                bool match = true;
+                for (int i = 0; i < 8 && match; ++i) match = v.in[i] == -1 || v.in[i] == b[i];
+                if (!match) continue;
+                int out = 0;
+                for (int i = 0; i < 8; ++i) out |= (v.out[i] == -1 ? b[i] : v.out[i]) << (2 * i);
+                table[idx] = uint16_t(out);
+                done = true;
+                break;
+            }
+    }
+    return table;
+}
+
+struct Margolus3D {
+    int w, h, d;                 // размеры по x, y (вниз), z; все чётные
+    std::vector<Cell> cells;     // индекс (y * d + z) * w + x, значения 0..3
+    bool offset = false;
+    long long generation = 0;
+    std::vector<Rule3> rules;
+    std::vector<uint16_t> table; // скомпилированные правила
+    int threads = default_threads();
+
+    Margolus3D(int W, int H, int D) : w(W), h(H), d(D), cells(size_t(W) * H * D, 0) {
+        set_rules(build_sand_rules_3d());
+    }
+
+    void set_rules(const std::vector<Rule3>& r) { rules = r; table = compile_rules3(rules); }
+
+    size_t index(int x, int y, int z) const { return (size_t(y) * d + z) * w + x; }
+    Cell& at(int x, int y, int z) { return cells[index(x, y, z)]; }
+
+    // Слой блоков с верхней плоскостью y0 при смещении o; блоки не пересекаются, поэтому сетка обновляется на месте
+    void step_layer(int y0, int o) {
+        int y1 = (y0 + 1) % h;
+        Cell* c = cells.data();
+        for (int z0 = o; z0 < d + o; z0 += 2) {
+            int za = z0 % d, zb = (z0 + 1) % d;
+            size_t r00 = (size_t(y0) * d + za) * w, r01 = (size_t(y0) * d + zb) * w;
+            size_t r10 = (size_t(y1) * d + za) * w, r11 = (size_t(y1) * d + zb) * w;
+            for (int x0 = o; x0 < w + o; x0 += 2) {
+                int xa = x0 % w, xb = (x0 + 1) % w;
+                size_t p[8] = { r00 + xa, r00 + xb, r01 + xa, r01 + xb, r10 + xa, r10 + xb, r11 + xa, r11 + xb };
+                unsigned in = 0;
+                for (int i = 0; i < 8; ++i) in |= unsigned(c[p[i]] & 3) << (2 * i);
+                unsigned out = table[in];
+                if (out == in) continue;
+                for (int i = 0; i < 8; ++i) c[p[i]] = Cell((out >> (2 * i)) & 3);
+            }
+        }
+    }
+
+    // Несколько поколений: полосы слоёв по y проходят волновым фронтом (wavefront, как в Margolus::advance),
+    // потоки создаются один раз на пачку, а не на каждое поколение
+    void advance(long long n) {
+        const int layers = h / 2;
+        const int bands = std::min(layers, std::max(1, threads) * 4);
+        std::vector<int> bound(size_t(bands) + 1);
+        for (int b = 0; b <= bands; ++b) bound[b] = 2 * int((long long)layers * b / bands);
+        const bool start_offset = offset;
+        wavefront(bands, threads, n, [&](int b, long long g) {
+            int o = start_offset != ((g & 1) != 0) ? 1 : 0;
+            for (int y0 = bound[b] + o; y0 < bound[b + 1] + o; y0 += 2) step_layer(y0 % h, o);
+        });
+        offset = start_offset != ((n & 1) != 0);
+        generation += n;
+    }
+
+    void step() { advance(1); }
+
+    // Случайное заполнение песком (счётчиковый генератор, как в двумерном автомате)
+    void randomize(double fill_prob, uint64_t seed = 12345) {
+        uint32_t thr = uint32_t(std::min(1.0, std::max(0.0, fill_prob)) * 4294967296.0 - 0.5);
+        const size_t n = cells.size(), CHUNK = size_t(1) << 16;
+        parallel_for(int((n + CHUNK - 1) / CHUNK), threads, [&](int ch, int) {
+            for (size_t i = size_t(ch) * CHUNK; i < std::min(n, size_t(ch + 1) * CHUNK); ++i)
+                cells[i] = Cell(fill_prob > 0 && uint32_t(mix64(seed ^ (0x9e3779b97f4a7c15ull * (i + 1)))) <= thr);
+        });
+    }
+
+    // Срез по оси axis ('x', 'y' или 'z') с координатой k; ширина и высота изображения возвращаются в sw, sh
+    std::vector<Cell> slice(char axis, int k, int& sw, int& sh) const {
+        std::vector<Cell> s;
+        if (axis == 'y') { sw = w; sh = d; s.resize(size_t(w) * d); for (int z = 0; z < d; ++z) for (int x = 0; x < w; ++x) s[size_t(z) * w + x] = cells[index(x, k, z)]; }
+        else if (axis == 'z') { sw = w; sh = h; s.resize(size_t(w) * h); for (int y = 0; y < h; ++y) for (int x = 0; x < w; ++x) s[size_t(y) * w + x] = cells[index(x, y, k)]; }
+        else { sw = d; sh = h; s.resize(size_t(d) * h); for (int y = 0; y < h; ++y) for (int z = 0; z < d; ++z) s[size_t(y) * d + z] = cells[index(k, y, z)]; }
+        return s;
+    }
+};
+
+// Запись траектории в формат NumPy .npy: массив (T, H, W) из uint8 или упакованный (T, H, ceil(W/4)),
+// где в каждом байте 4 ячейки по 2 бита (младшие биты — левая ячейка).
+// Заголовок занимает ровно NPY_HEADER байт (данные выровнены на страницу) и перезаписывается
+// при закрытии с итоговым T. Кадры копируются в крупные буферы, запись на диск идёт в фоновом потоке.
+const size_t NPY_HEADER = 4096;
+const size_t NPY_CHUNK = 8u << 20; // размер одной записи на диск
+
+std::string npy_header(long long t, int h, int row_bytes) {
+    std::string dict = "{'descr': '|u1', 'fortran_order': False, 'shape': (" + std::to_string(t) + ", "
+        + std::to_string(h) + ", " + std::to_string(row_bytes) + "), }";
+    std::string hdr = "\x93NUMPY";
+    hdr += char(1); hdr += char(0);                    // версия 1.0
+    size_t len = NPY_HEADER - 10;
+    hdr += char(len & 0xff); hdr += char(len >> 8);    // длина словаря (little-endian)
+    hdr += dict;
+    hdr.append(NPY_HEADER - 1 - hdr.size(), ' ');
+    hdr += '\n';
+    return hdr;
+}
+
+struct NpyTrajectoryWriter {
+    std::FILE* f = nullptr;
+    int w = 0, h = 0, row_bytes = 0;
+    bool packed = false;
+    int every = 1;           // записывать каждое every-е поколение
+    long long frames = 0;
+
+    std::vector<uint8_t> chunk;                 // заполняемый буфер
+    std::vector<std::vector<uint8_t>> queue;    // буферы, ожидающие записи
+    std::vector<std::vector<uint8_t>> spare;    // освободившиеся буферы
+    std::mutex m;
+    std::condition_variable cv;
+    std::thread worker;
+    bool stopping = false;
+    std::atomic<bool> failed{ false }; // ошибка записи (пишет фоновый поток)
+    std::atomic<size_t> depth{ 0 }; // длина очереди (для мониторинга)
+
+    ~NpyTrajectoryWriter() { close(); }
+
+    bool open(const std::string& path, int W, int H, bool pack, int sample_every) {
+        f = std::fopen(path.c_str(), "wb");
+        if (!f) return false;
+        w = W; h = H; packed = pack; every = std::max(1, sample_every);
+        row_bytes = packed ? (w + 3) / 4 : w;
+        frames = 0;
+        std::string hdr = npy_header(0, h, row_bytes);
+        failed = false;
+        if (std::fwrite(hdr.data(), 1, hdr.size(), f) != hdr.size()) {
+            std::fclose(f);
+            f = nullptr;
+            return false;
+        }
+        std::setvbuf(f, nullptr, _IONBF, 0); // буферизация своя, крупными блоками
+        chunk.reserve(NPY_CHUNK + size_t(h) * row_bytes);
+        stopping = false;
+        worker = std::thread([this] { write_loop(); });
+        return true;
+    }
+
+    void write_loop() {
+        std::unique_lock<std::mutex> lk(m);
+        for (;;) {
+            cv.wait(lk, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            std::vector<uint8_t> buf = std::move(queue.front());
+            queue.erase(queue.begin());
+            depth = queue.size();
+            lk.unlock();
+            if (std::fwrite(buf.data(), 1, buf.size(), f) != buf.size()) failed = true;
+            buf.clear();
+            lk.lock();
+            spare.push_back(std::move(buf));
+            cv.notify_all();
+        }
+    }
+
+    // Добавление текущего поколения (если оно попадает в выборку); вызывается после step()
+    void push(const Margolus& sim) {
+        if (!f || sim.generation % every != 0) return;
+        size_t base = chunk.size();
+        chunk.resize(base + size_t(h) * row_bytes);
+        uint8_t* dst = chunk.data() + base;
+        if (!packed) {
+            for (size_t i = 0; i < sim.cells.size(); ++i) dst[i] = uint8_t(sim.cells[i]);
+        }
+        else {
+            std::fill(dst, dst + size_t(h) * row_bytes, 0);
+            for (int y = 0; y < h; ++y)
+                for (int x = 0; x < w; ++x)
+                    dst[size_t(y) * row_bytes + x / 4] |= uint8_t((sim.cells[y * w + x] & 3) << ((x & 3) * 2));
+        }
+        ++frames;
+        if (chunk.size() >= NPY_CHUNK) flush_chunk();
+    }
+
+    // Передача заполненного буфера фоновому потоку; ждём только если диск отстал на несколько буферов
+    void flush_chunk() {
+        if (chunk.empty()) return;
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return queue.size() < 8; });
+        queue.push_back(std::move(chunk));
+        depth = queue.size();
+        chunk = std::vector<uint8_t>();
+        if (!spare.empty()) { chunk = std::move(spare.back()); spare.pop_back(); }
+        else chunk.reserve(NPY_CHUNK + size_t(h) * row_bytes);
+        cv.notify_all();
+    }
+
+    // Дозапись остатка и обновление формы массива в заголовке
+    bool close() {
+        if (!f) return !failed;
+        flush_chunk();
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+        std::string hdr = npy_header(frames, h, row_bytes);
+        std::fseek(f, 0, SEEK_SET);
+        if (std::fwrite(hdr.data(), 1, hdr.size(), f) != hdr.size()) failed = true;
+        if (std::fclose(f) != 0) failed = true;
+        f = nullptr;
+        return !failed;
+    }
+};
+
+// Чтение траектории .npy через отображение файла в память: произвольный доступ к поколениям
+struct NpyTrajectoryReader {
+    const uint8_t* data = nullptr; // начало файла
+    size_t size = 0;
+    long long frames = 0;
+    int h = 0, row_bytes = 0;
+    size_t offset = 0;             // смещение данных
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+
+    ~NpyTrajectoryReader() { close(); }
+
+    bool open(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER sz;
+        GetFileSizeEx(file, &sz);
+        size = size_t(sz.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) { close(); return false; }
+        data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!data) { close(); return false; }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0) { ::close(fd); return false; }
+        size = size_t(st.st_size);
+        void* p = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        data = (const uint8_t*)p;
+#endif
+        if (size < 10 || std::memcmp(data, "\x93NUMPY", 6) != 0) { close(); return false; }
+        offset = 10 + size_t(data[8]) + (size_t(data[9]) << 8);
+        std::string dict((const char*)data + 10, offset - 10);
+        size_t s = dict.find("'shape': (");
+        if (s == std::string::npos || offset > size) { close(); return false; }
+        int w = 0;
+        if (std::sscanf(dict.c_str() + s + 10, "%lld, %d, %d", &frames, &h, &w) != 3
+            || frames < 0 || h <= 0 || w <= 0 || (unsigned long long)frames > (size - offset) / (size_t(h) * size_t(w))) {
+            close();
+            return false;
+        }
+        row_bytes = w;
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr; file = INVALID_HANDLE_VALUE;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+    }
+
+    // Кадр номер t (строки по row_bytes байт); nullptr, если такого кадра нет
+    const uint8_t* frame(long long t) const {
+        if (!data || t < 0 || t >= frames) return nullptr;
+        return data + offset + size_t(t) * size_t(h) * row_bytes;
+    }
+
+    // Состояние ячейки; packed — файл записан в упакованном виде; -1 вне файла
+    int cell(long long t, int x, int y, bool packed = false) const {
+        const uint8_t* f = frame(t);
+        if (!f || y < 0 || y >= h || x < 0 || (packed ? x / 4 : x) >= row_bytes) return -1;
+        const uint8_t* row = f + size_t(y) * row_bytes;
+        return packed ? (row[x / 4] >> ((x & 3) * 2)) & 3 : row[x];
+    }
+};
+
+// Проверка записанной траектории .npy (--verify): число кадров и последний кадр, если он совпадает
+// с текущим поколением. Упакованный файл сравнивается по младшим двум битам.
+bool verify_npy(const std::string& path, const NpyTrajectoryWriter& npy, const Margolus& sim) {
+    NpyTrajectoryReader r;
+    if (!r.open(path) || r.frames != npy.frames || r.h != sim.h || r.row_bytes != npy.row_bytes) return false;
+    if (r.frames == 0 || sim.generation % npy.every != 0) return true;
+    for (int y = 0; y < sim.h; ++y)
+        for (int x = 0; x < sim.w; ++x) {
+            int c = sim.cells[size_t(y) * sim.w + x];
+            if (r.cell(r.frames - 1, x, y, npy.packed) != (npy.packed ? c & 3 : c)) return false;
+        }
+    return true;
+}
+
+// Сжатие PackBits: управляющий байт n < 128 — далее n+1 байт как есть, n >= 128 — повтор следующего байта n-125 раз
+// Наибольший размер сжатых данных для n байт (одни литералы: управляющий байт на каждые 128)
+inline size_t rle_bound(size_t n) { return n + (n + 127) / 128; }
+
+// Сжатие в заранее выделенный буфер не меньше rle_bound(n); возвращает размер. Без выделения памяти —
+// вызывается и в дочернем процессе после fork()
+size_t rle_compress(const uint8_t* src, size_t n, uint8_t* dst) {
+    size_t i = 0, o = 0;
+    while (i < n) {
+        size_t run = 1;
+        while (i + run < n && run < 130 && src[i + run] == src[i]) ++run;
+        if (run >= 3) {
+            dst[o++] = uint8_t(run + 125);
+            dst[o++] = src[i];
+            i += run;
+            continue;
+        }
+        size_t lit = 0;
+        while (i + lit < n && lit < 128) {
+            if (i + lit + 2 < n && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2]) break;
+            ++lit;
+        }
+        dst[o++] = uint8_t(lit - 1);
+        std::memcpy(dst + o, src + i, lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+
+void rle_compress(const uint8_t* src, size_t n, std::vector<uint8_t>& dst) {
+    size_t base = dst.size();
+    dst.resize(base + rle_bound(n));
+    dst.resize(base + rle_compress(src, n, dst.data() + base));
+}
+
+// limit — наибольший допустимый размер dst (защита от испорченных данных)
+bool rle_decompress(const uint8_t* src, size_t n, std::vector<uint8_t>& dst, size_t limit = SIZE_MAX) {
+    size_t i = 0;
+    while (i < n) {
+        uint8_t c = src[i++];
+        if (dst.size() + (c < 128 ? size_t(c) + 1 : size_t(c) - 125) > limit) return false;
+        if (c < 128) {
+            if (i + c + 1 > n) return false;
+            dst.insert(dst.end(), src + i, src + i + c + 1);
+            i += c + 1;
+        }
+        else {
+            if (i >= n) return false;
+            dst.insert(dst.end(), size_t(c) - 125, src[i++]);
+        }
+    }
+    return true;
+}
+
+void put_varint(std::vector<uint8_t>& v, uint64_t x) {
+    while (x >= 0x80) { v.push_back(uint8_t(x | 0x80)); x >>= 7; }
+    v.push_back(uint8_t(x));
+}
+
+bool get_varint(const std::vector<uint8_t>& v, size_t& i, uint64_t& x) {
+    x = 0;
+    for (int shift = 0; i < v.size() && shift < 64; shift += 7) {
+        uint8_t b = v[i++];
+        x |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// Архив траектории: независимо сжатые фрагменты, каждый — ключевой кадр и изменения блоков
+// для следующих K-1 поколений; в конце файла — индекс фрагментов.
+//   заголовок: "MSARCH1\0", w, h, K (по 4 байта)
+//   фрагмент:  RLE( кадр w*h байт | для каждого поколения: число блоков, затем (разность индексов, 4 ячейки) )
+//   индекс:    для каждого фрагмента — первое поколение, смещение, сжатый и исходный размеры (по 8 байт)
+//   окончание: смещение индекса (8 байт), число фрагментов (4 байта), "MSIDX1\0\0"
+struct ArchiveChunkInfo {
+    uint64_t first_gen, offset, packed_size, raw_size;
+};
+
+template <class T> void write_pod(std::FILE* f, const T& v) { std::fwrite(&v, sizeof(T), 1, f); }
+template <class T> bool read_pod(std::FILE* f, T& v) { return std::fread(&v, sizeof(T), 1, f) == 1; }
+
+// 64-битные смещения в файле (long в Windows 32-битный, архивы бывают больше 2 ГБ)
+inline long long file_tell(std::FILE* f) {
+#ifdef _WIN32
+    return _ftelli64(f);
+#else
+    return (long long)ftello(f);
+#endif
+}
+
+inline bool file_seek(std::FILE* f, long long off, int whence) {
+#ifdef _WIN32
+    return _fseeki64(f, off, whence) == 0;
+#else
+    return fseeko(f, off_t(off), whence) == 0;
+#endif
+}
+
+struct TrajectoryArchiveWriter {
+    std::FILE* f = nullptr;
+    int w = 0, h = 0, K = 256;
+    std::vector<uint8_t> raw;           // несжатый текущий фрагмент
+    long long chunk_gen = -1;           // первое поколение текущего фрагмента
+    long long last_gen = -1;
+    std::vector<ArchiveChunkInfo> index;
+    uint64_t raw_total = 0, packed_total = 0;
+
+    ~TrajectoryArchiveWriter() { close(); }
+
+    bool open(const std::string& path, int W, int H, int keyframe_interval) {
+        f = std::fopen(path.c_str(), "wb");
+        if (!f) return false;
+        w = W; h = H; K = std::max(1, keyframe_interval);
+        std::fwrite("MSARCH1\0", 1, 8, f);
+        write_pod(f, int32_t(w)); write_pod(f, int32_t(h)); write_pod(f, int32_t(K));
+        return true;
+    }
+
+    // Добавление поколения: ключевой кадр каждые K поколений, иначе изменения последнего шага.
+    // Вызывается после каждого step(); пропуск поколения начинает новый фрагмент.
+    void push(const Margolus& sim) {
+        if (!f) return;
+        bool key = chunk_gen < 0 || sim.generation - chunk_gen >= K || sim.generation != last_gen + 1;
+        if (key) {
+            flush_chunk();
+            chunk_gen = sim.generation;
+            raw.resize(sim.cells.size());
+            for (size_t i = 0; i < sim.cells.size(); ++i) raw[i] = uint8_t(sim.cells[i]);
+        }
+        else {
+            put_varint(raw, sim.changed.size());
+            int prev = 0;
+            for (int idx : sim.changed) {
+                put_varint(raw, uint64_t(idx - prev));
+                prev = idx;
+                int x0 = idx % w, y0 = idx / w, x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+                raw.push_back(uint8_t(sim.cells[y0 * w + x0])); raw.push_back(uint8_t(sim.cells[y0 * w + x1]));
+                raw.push_back(uint8_t(sim.cells[y1 * w + x0])); raw.push_back(uint8_t(sim.cells[y1 * w + x1]));
+            }
+        }
+        last_gen = sim.generation;
+        raw_total += size_t(w) * h;
+    }
+
+    void flush_chunk() {
+        if (chunk_gen < 0) return;
+        std::vector<uint8_t> packed;
+        rle_compress(raw.data(), raw.size(), packed);
+        ArchiveChunkInfo ci{ uint64_t(chunk_gen), uint64_t(file_tell(f)), packed.size(), raw.size() };
+        std::fwrite(packed.data(), 1, packed.size(), f);
+        index.push_back(ci);
+        packed_total += packed.size();
+        raw.clear();
+        chunk_gen = -1;
+    }
+
+    bool close() {
+        if (!f) return true;
+        flush_chunk();
+        uint64_t index_offset = uint64_t(file_tell(f));
+        for (const auto& ci : index) {
+            write_pod(f, ci.first_gen); write_pod(f, ci.offset);
+            write_pod(f, ci.packed_size); write_pod(f, ci.raw_size);
+        }
+        write_pod(f, index_offset);
+        write_pod(f, uint32_t(index.size()));
+        std::fwrite("MSIDX1\0\0", 1, 8, f);
+        bool ok = std::fclose(f) == 0;
+        f = nullptr;
+        return ok;
+    }
+};
+
+struct TrajectoryArchiveReader {
+    std::string path;
+    int w = 0, h = 0, K = 0;
+    std::vector<ArchiveChunkInfo> index;
+
+    bool open(const std::string& p) {
+        path = p;
+        std::FILE* f = std::fopen(p.c_str(), "rb");
+        if (!f) return false;
+        char magic[8];
+        int32_t W, H, KK;
+        bool ok = std::fread(magic, 1, 8, f) == 8 && std::memcmp(magic, "MSARCH1\0", 8) == 0
+            && read_pod(f, W) && read_pod(f, H) && read_pod(f, KK);
+        uint64_t index_offset = 0;
+        uint32_t count = 0;
+        char tail[8];
+        long long size = ok && file_seek(f, 0, SEEK_END) ? file_tell(f) : -1;
+        // окончание проверяется до того, как ему доверять: сигнатура и индекс ровно до конца файла
+        ok = ok && size >= 8 + 12 + 20 && file_seek(f, -20, SEEK_END) && read_pod(f, index_offset) && read_pod(f, count)
+            && std::fread(tail, 1, 8, f) == 8 && std::memcmp(tail, "MSIDX1\0\0", 8) == 0
+            && index_offset >= 8 + 12 && index_offset + uint64_t(count) * sizeof(ArchiveChunkInfo) + 20 == uint64_t(size)
+            && file_seek(f, (long long)index_offset, SEEK_SET);
+        ok = ok && W > 0 && H > 0 && KK > 0 && uint64_t(W) * uint64_t(H) <= uint64_t(INT32_MAX);
+        for (uint32_t i = 0; ok && i < count; ++i) {
+            ArchiveChunkInfo ci;
+            ok = read_pod(f, ci.first_gen) && read_pod(f, ci.offset) && read_pod(f, ci.packed_size) && read_pod(f, ci.raw_size)
+                && ci.offset <= index_offset && ci.packed_size <= index_offset - ci.offset
+                && ci.raw_size <= ci.packed_size * 65; // PackBits разворачивает 2 байта не больше чем в 130
+            index.push_back(ci);
+        }
+        std::fclose(f);
+        w = W; h = H; K = KK;
+        return ok;
+    }
+
+    long long first_generation() const { return index.empty() ? 0 : (long long)index.front().first_gen; }
+
+    // Номер фрагмента, содержащего поколение gen (-1, если такого нет)
+    int chunk_of(long long gen) const {
+        auto it = std::upper_bound(index.begin(), index.end(), uint64_t(gen),
+            [](uint64_t g, const ArchiveChunkInfo& ci) { return g < ci.first_gen; });
+        return it == index.begin() ? -1 : int(it - index.begin()) - 1;
+    }
+
+    // Распаковка фрагмента (каждый поток открывает файл сам — фрагменты декодируются независимо)
+    bool load_chunk(int c, std::vector<uint8_t>& raw) const {
+        std::FILE* f = std::fopen(path.c_str(), "rb");
+        if (!f) return false;
+        std::vector<uint8_t> packed(size_t(index[c].packed_size));
+        bool ok = file_seek(f, (long long)index[c].offset, SEEK_SET)
+            && std::fread(packed.data(), 1, packed.size(), f) == packed.size();
+        std::fclose(f);
+        raw.clear();
+        raw.reserve(size_t(index[c].raw_size));
+        return ok && rle_decompress(packed.data(), packed.size(), raw) && raw.size() == index[c].raw_size;
+    }
+
+    // Восстановление кадров фрагмента c по поколениям [first_gen, gen]: ключевой кадр и повтор изменений.
+    // visit(gen, frame) вызывается для каждого восстановленного поколения.
+    template <class Visit>
+    bool replay_chunk(int c, long long gen, Visit visit) const {
+        std::vector<uint8_t> raw;
+        if (!load_chunk(c, raw) || raw.size() < size_t(w) * h) return false;
+        std::vector<uint8_t> frame(raw.begin(), raw.begin() + size_t(w) * h);
+        size_t i = frame.size();
+        long long g = (long long)index[c].first_gen;
+        visit(g, frame);
+        while (g < gen && i < raw.size()) {
+            uint64_t n, gap;
+            if (!get_varint(raw, i, n)) return false;
+            uint64_t idx = 0;
+            for (uint64_t k = 0; k < n; ++k) {
+                if (!get_varint(raw, i, gap) || i + 4 > raw.size()) return false;
+                idx += gap;
+                if (gap >= frame.size() || idx >= frame.size()) return false; // испорченный фрагмент
+                int x0 = int(idx % w), y0 = int(idx / w), x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+                frame[y0 * w + x0] = raw[i]; frame[y0 * w + x1] = raw[i + 1];
+                frame[y1 * w + x0] = raw[i + 2]; frame[y1 * w + x1] = raw[i + 3];
+                i += 4;
+            }
+            visit(++g, frame);
+        }
+        return g == gen;
+    }
+
+    // Кадр поколения gen: переход к ключевому кадру и повтор изменений
+    bool decode(long long gen, std::vector<uint8_t>& out) const {
+        int c = chunk_of(gen);
+        if (c < 0) return false;
+        return replay_chunk(c, gen, [&](long long g, const std::vector<uint8_t>& frame) { if (g == gen) out = frame; });
+    }
+
+    // Параллельная распаковка набора поколений: фрагменты распределяются между потоками
+    bool decode_many(const std::vector<long long>& gens, std::vector<std::vector<uint8_t>>& out, int threads) const {
+        out.assign(gens.size(), std::vector<uint8_t>());
+        std::vector<int> chunks;
+        for (long long g : gens) chunks.push_back(chunk_of(g));
+        std::vector<int> uniq = chunks;
+        std::sort(uniq.begin(), uniq.end());
+        uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+        std::atomic<size_t> next{ 0 };
+        std::atomic<bool> ok{ uniq.empty() || uniq.front() >= 0 };
+        auto work = [&] {
+            for (size_t u; ok && (u = next++) < uniq.size();) {
+                int c = uniq[u];
+                long long last = 0;
+                for (size_t k = 0; k < gens.size(); ++k) if (chunks[k] == c) last = std::max(last, gens[k]);
+                bool r = replay_chunk(c, last, [&](long long g, const std::vector<uint8_t>& frame) {
+                    for (size_t k = 0; k < gens.size(); ++k) if (chunks[k] == c && gens[k] == g) out[k] = frame;
+                });
+                if (!r) ok = false;
+            }
+        };
+        std::vector<std::thread> pool;
+        for (int t = 1; t < std::max(1, threads); ++t) pool.emplace_back(work);
+        work();
+        for (auto& t : pool) t.join();
+        return ok;
+    }
+};
+
+// Проверка записанного архива (--verify): все ключевые кадры распаковываются параллельно,
+// а последнее поколение, восстановленное повтором изменений, совпадает с сеткой
+bool verify_archive(const std::string& path, const Margolus& sim) {
+    TrajectoryArchiveReader r;
+    if (!r.open(path) || r.w != sim.w || r.h != sim.h) return false;
+    std::vector<long long> gens;
+    for (const auto& ci : r.index) gens.push_back((long long)ci.first_gen);
+    std::vector<std::vector<uint8_t>> keyframes;
+    std::vector<uint8_t> last;
+    if (!r.decode_many(gens, keyframes, std::max(1, sim.threads)) || !r.decode(sim.generation, last)) return false;
+    return std::equal(sim.cells.begin(), sim.cells.end(), last.begin(), last.end());
+}
+
+// Контрольная точка (и штамп): "MSCKPT1\0", ширина и высота (int32), поколение (int64), смещение блоков (1 байт),
+// размер сжатых данных (uint64), затем RLE-сжатые ячейки по байту на ячейку.
+// Ячейки сжимаются порциями по строкам (поток RLE допускает склейку), размер дописывается в конце;
+// progress (если задан) получает долю записанных ячеек.
+const size_t CHECKPOINT_HEADER = 8 + 4 + 4 + 8 + 1 + 8;
+
+// Порция сжатия: целые строки, около 4 МБ
+inline size_t checkpoint_chunk(int w) {
+    const size_t CHUNK = size_t(1) << 22;
+    return std::max(size_t(w), CHUNK / std::max(1, w) * w);
+}
+
+// Заголовок с размером сжатых данных packed_size (при записи порциями дописывается в конце)
+inline void checkpoint_header(uint8_t* out, int w, int h, long long gen, bool offset, uint64_t packed_size) {
+    int32_t W = w, H = h;
+    int64_t G = gen;
+    std::memcpy(out, "MSCKPT1\0", 8);
+    std::memcpy(out + 8, &W, 4); std::memcpy(out + 12, &H, 4);
+    std::memcpy(out + 16, &G, 8);
+    out[24] = uint8_t(offset);
+    std::memcpy(out + 25, &packed_size, 8);
+}
+
+bool save_checkpoint(const std::string& path, int w, int h, long long gen, bool offset, const std::vector<Cell>& cells,
+    const std::function<void(double)>& progress = nullptr) {
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    uint8_t hdr[CHECKPOINT_HEADER];
+    checkpoint_header(hdr, w, h, gen, offset, 0);
+    std::fwrite(hdr, 1, sizeof hdr, f);
+    size_t chunk = checkpoint_chunk(w);
+    uint64_t total = 0;
+    bool ok = true;
+    std::vector<uint8_t> packed;
+    for (size_t i = 0; ok && i < cells.size(); i += chunk) {
+        size_t n = std::min(chunk, cells.size() - i);
+        packed.clear();
+        rle_compress(cells.data() + i, n, packed);
+        ok = std::fwrite(packed.data(), 1, packed.size(), f) == packed.size();
+        total += packed.size();
+        if (progress) progress(double(i + n) / double(cells.size()));
+    }
+    ok = ok && std::fseek(f, long(CHECKPOINT_HEADER - 8), SEEK_SET) == 0;
+    write_pod(f, total);
+    return std::fclose(f) == 0 && ok;
+}
+
+bool load_checkpoint(const std::string& path, int& w, int& h, long long& gen, bool& offset, std::vector<Cell>& cells) {
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) return false;
+    char magic[8];
+    int32_t W = 0, H = 0;
+    int64_t G = 0;
+    uint8_t off = 0;
+    uint64_t n = 0;
+    bool ok = std::fread(magic, 1, 8, f) == 8 && std::memcmp(magic, "MSCKPT1\0", 8) == 0
+        && read_pod(f, W) && read_pod(f, H) && read_pod(f, G) && read_pod(f, off) && read_pod(f, n)
+        && W > 0 && H > 0 && uint64_t(W) * uint64_t(H) <= uint64_t(INT32_MAX);
+    // размер из заголовка проверяется до выделения памяти: не больше остатка файла и сжатой сетки W×H
+    long long size = ok && file_seek(f, 0, SEEK_END) ? file_tell(f) : -1;
+    ok = ok && size >= (long long)CHECKPOINT_HEADER && n <= uint64_t(size) - CHECKPOINT_HEADER
+        && n <= rle_bound(size_t(W) * size_t(H)) && file_seek(f, (long long)CHECKPOINT_HEADER, SEEK_SET);
+    std::vector<uint8_t> packed(ok ? size_t(n) : 0), raw;
+    ok = ok && std::fread(packed.data(), 1, packed.size(), f) == packed.size();
+    std::fclose(f);
+    if (ok) raw.reserve(size_t(W) * size_t(H));
+    ok = ok && rle_decompress(packed.data(), packed.size(), raw, size_t(W) * size_t(H)) && raw.size() == size_t(W) * size_t(H)
+        && valid_states(raw);
+    if (!ok) return false;
+    w = W; h = H; gen = G; offset = off != 0;
+    cells.swap(raw);
+    return true;
+}
+
+bool save_checkpoint(const Margolus& sim, const std::string& path) {
+    return save_checkpoint(path, sim.w, sim.h, sim.generation, sim.offset, sim.cells);
+}
+
+// Загрузка в автомат того же размера
+bool load_checkpoint(Margolus& sim, const std::string& path) {
+    int w, h;
+    long long gen;
+    bool offset;
+    std::vector<Cell> cells;
+    if (!load_checkpoint(path, w, h, gen, offset, cells) || w != sim.w || h != sim.h) return false;
+    sim.cells.swap(cells);
+    sim.generation = gen;
+    sim.offset = offset;
+    sim.rebuild_stats();
+    if (sim.track_ids) sim.enable_ids(true);
+    return true;
+}
+
+bool save_stamp(const Region& r, const std::string& path) {
+    return save_checkpoint(path, r.w, r.h, 0, false, r.cells);
+}
+
+bool load_stamp(const std::string& path, Region& r) {
+    long long gen;
+    bool offset;
+    return load_checkpoint(path, r.w, r.h, gen, offset, r.cells);
+}
+
+// Библиотека штампов: встроенные и сохранённые в каталоге dir (*.msc)
+std::vector<std::pair<std::string, Region>> load_stamp_library(const std::string& dir) {
+    std::vector<std::pair<std::string, Region>> lib = builtin_stamps();
+    std::error_code ec;
+    std::vector<std::filesystem::path> files;
+    for (const auto& e : std::filesystem::directory_iterator(dir, ec))
+        if (e.path().extension() == ".msc") files.push_back(e.path());
+    std::sort(files.begin(), files.end());
+    for (const auto& p : files) {
+        Region r;
+        if (load_stamp(p.string(), r)) lib.push_back({ p.stem().string(), r });
+    }
+    return lib;
+}
+
+// Фоновый поток, выполняющий задания по одному (например, пачку шагов второго автомата)
+struct StepWorker {
+    std::thread th;
+    std::mutex m;
+    std::condition_variable cv;
+    std::function<void()> job;
+    bool busy = false, quit = false;
+
+    StepWorker() {
+        th = std::thread([this] {
+            std::unique_lock<std::mutex> lk(m);
+            for (;;) {
+                cv.wait(lk, [this] { return quit || job; });
+                if (!job) return;
+                lk.unlock();
+                job();
+                lk.lock();
+                job = nullptr;
+                busy = false;
+                cv.notify_all();
+            }
+        });
+    }
+
+    ~StepWorker() {
+        wait();
+        { std::lock_guard<std::mutex> lk(m); quit = true; }
+        cv.notify_all();
+        th.join();
+    }
+
+    void run(std::function<void()> f) {
+        std::lock_guard<std::mutex> lk(m);
+        job = std::move(f);
+        busy = true;
+        cv.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [this] { return !busy; });
+    }
+};
+
+// Карта расхождения двух автоматов по тайлам. Тайлы перепроверяются только там,
+// где хотя бы один из автоматов изменил блоки (или ячейки были отредактированы).
+struct TileDivergence {
+    int w = 0, h = 0, tile = 8, tiles_x = 0, tiles_y = 0;
+    std::vector<uint8_t> dirty_a, dirty_b; // отметки изменений; каждая заполняется своим потоком
+    std::vector<uint8_t> diverged;         // 1 — в тайле есть различающиеся ячейки
+    int diverged_count = 0;
+
+    TileDivergence(int W, int H, int T = 8) : w(W), h(H), tile(T) {
+        tiles_x = (w + tile - 1) / tile;
+        tiles_y = (h + tile - 1) / tile;
+        dirty_a.assign(size_t(tiles_x) * tiles_y, 1);
+        dirty_b = diverged = std::vector<uint8_t>(size_t(tiles_x) * tiles_y, 0);
+    }
+
+    void mark_cell(std::vector<uint8_t>& dirty, int x, int y) {
+        dirty[size_t(y / tile) * tiles_x + x / tile] = 1;
+    }
+
+    // Отметка всех тайлов прямоугольника {x0, y0, x1, y1} (включительно; пустой, если x1 < x0)
+    void mark_box(std::vector<uint8_t>& dirty, const std::array<int, 4>& b) {
+        for (int ty = std::max(0, b[1]) / tile; ty <= std::min(h - 1, b[3]) / tile && b[3] >= b[1]; ++ty)
+            for (int tx = std::max(0, b[0]) / tile; tx <= std::min(w - 1, b[2]) / tile && b[2] >= b[0]; ++tx)
+                dirty[size_t(ty) * tiles_x + tx] = 1;
+    }
+
+    // Отметка тайлов, затронутых блоками последнего шага
+    void mark_changes(std::vector<uint8_t>& dirty, const Margolus& s) {
+        for (int idx : s.changed) {
+            int x0 = idx % w, y0 = idx / w, x1 = (x0 + 1) % w, y1 = (y0 + 1) % h;
+            mark_cell(dirty, x0, y0); mark_cell(dirty, x1, y0);
+            mark_cell(dirty, x0, y1); mark_cell(dirty, x1, y1);
+        }
+    }
+
+    // Сравнение отмеченных тайлов
+    void update(const Margolus& a, const Margolus& b) {
+        for (int ty = 0; ty < tiles_y; ++ty) {
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                size_t t = size_t(ty) * tiles_x + tx;
+                if (!dirty_a[t] && !dirty_b[t]) continue;
+                dirty_a[t] = dirty_b[t] = 0;
+                bool diff = false;
+                for (int y = ty * tile; y < std::min(h, ty * tile + tile) && !diff; ++y)
+                    diff = !std::equal(a.cells.begin() + y * w + tx * tile,
+                        a.cells.begin() + y * w + std::min(w, tx * tile + tile), b.cells.begin() + y * w + tx * tile);
+                diverged_count += int(diff) - int(diverged[t]);
+                diverged[t] = diff;
+            }
+        }
+    }
+};
+
+// Монотонное время в наносекундах
+inline uint64_t now_ns() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Контрольная точка без остановки симуляции. На POSIX снимок делает fork(): дочерний процесс
+// получает сетку по принципу copy-on-write (пауза родителя — только копирование таблиц страниц),
+// сжимает и пишет её во временный файл, сообщая проценты по каналу, затем переименовывает файл.
+// В родителе могут работать другие потоки, поэтому дочерний процесс вызывает только безопасные после
+// fork() функции (open, write, pwrite, rename, _exit): буфер сжатия, заголовок и имена готовятся заранее.
+// Где fork() нет (Windows) или он не удался, сетка копируется и пишется в фоновом потоке.
+struct BackgroundCheckpoint {
+    std::string path;
+    long long generation = -1;   // поколение текущего (или последнего) снимка
+    int progress = -1;           // проценты; -1 — запись не идёт
+    double pause_ms = 0.0;       // остановка симуляции при запуске снимка
+    uint64_t start_ns = 0;
+    double write_ms = 0.0;       // длительность последней записи
+
+    std::thread writer;          // запасной путь: запись копии в потоке
+    std::atomic<int> thread_progress{ 0 };
+    std::atomic<int> thread_result{ -1 }; // -1 — идёт, 0 — ошибка, 1 — готово
+#ifndef _WIN32
+    pid_t child = -1;
+    int progress_fd = -1;
+    std::vector<uint8_t> packed; // буфер сжатия дочернего процесса (выделяется до fork)
+
+    static bool write_all(int fd, const uint8_t* p, size_t n) {
+        while (n > 0) {
+            ssize_t k = ::write(fd, p, n);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) return false;
+            p += k;
+            n -= size_t(k);
+        }
+        return true;
+    }
+
+    // Тело дочернего процесса: только вызовы, допустимые после fork() в многопоточной программе
+    [[noreturn]] void child_write(const Margolus& sim, const char* tmp, const char* dst, int progress_out) {
+        uint8_t hdr[CHECKPOINT_HEADER];
+        checkpoint_header(hdr, sim.w, sim.h, sim.generation, sim.offset, 0);
+        int fd = ::open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd >= 0 && write_all(fd, hdr, sizeof hdr);
+        const size_t n = sim.cells.size(), chunk = checkpoint_chunk(sim.w);
+        uint64_t total = 0;
+        uint8_t last = 0;
+        for (size_t i = 0; ok && i < n; i += chunk) {
+            size_t len = rle_compress(sim.cells.data() + i, std::min(chunk, n - i), packed.data());
+            ok = write_all(fd, packed.data(), len);
+            total += len;
+            uint8_t b = uint8_t(std::min<size_t>(99, (i + std::min(chunk, n - i)) * 100 / n));
+            if (b != last && ::write(progress_out, &b, 1) == 1) last = b;
+        }
+        ok = ok && ::pwrite(fd, &total, sizeof total, off_t(CHECKPOINT_HEADER - 8)) == ssize_t(sizeof total);
+        if (fd >= 0) ok = ::close(fd) == 0 && ok;
+        ok = ok && ::rename(tmp, dst) == 0;
+        _exit(ok ? 0 : 1);
+    }
+#endif
+
+    ~BackgroundCheckpoint() {
+        while (active() && poll() == 0) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    bool active() const { return progress >= 0; }
+
+    // Запуск записи на границе поколения; false, если предыдущая запись ещё идёт
+    bool start(const Margolus& sim, const std::string& file) {
+        if (active()) return false;
+        path = file;
+        generation = sim.generation;
+        progress = 0;
+        start_ns = now_ns();
+        std::string tmp = path + ".tmp";
+#ifndef _WIN32
+        int fds[2];
+        packed.resize(rle_bound(checkpoint_chunk(sim.w)));
+        if (pipe(fds) == 0) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                child_write(sim, tmp.c_str(), path.c_str(), fds[1]);
+            }
+            close(fds[1]);
+            if (pid > 0) {
+                child = pid;
+                progress_fd = fds[0];
+                fcntl(progress_fd, F_SETFL, fcntl(progress_fd, F_GETFL) | O_NONBLOCK);
+                pause_ms = double(now_ns() - start_ns) * 1e-6;
+                return true;
+            }
+            close(fds[0]);
+        }
+#endif
+        std::vector<Cell> copy = sim.cells;
+        int w = sim.w, h = sim.h;
+        bool offset = sim.offset;
+        thread_progress = 0;
+        thread_result = -1;
+        writer = std::thread([this, tmp, copy = std::move(copy), w, h, offset] {
+            bool ok = save_checkpoint(tmp, w, h, generation, offset, copy, [this](double p) {
+                thread_progress.store(int(std::min(99.0, p * 100.0)), std::memory_order_relaxed);
+                }) && std::rename(tmp.c_str(), path.c_str()) == 0;
+            thread_result = ok ? 1 : 0;
+            });
+        pause_ms = double(now_ns() - start_ns) * 1e-6;
+        return true;
+    }
 
-    Margolus(int W, int H) : w(W), h(H), cells(W* H, 0) {
-        rules = build_sand_rules();
+    // Опрос без блокировки: 0 — запись идёт (или не запускалась), 1 — завершена, -1 — ошибка
+    int poll() {
+        if (!active()) return 0;
+        int result = -1;
+#ifndef _WIN32
+        if (child > 0) {
+            uint8_t buf[64];
+            ssize_t n;
+            while ((n = ::read(progress_fd, buf, sizeof buf)) > 0) progress = buf[n - 1];
+            int status = 0;
+            if (waitpid(child, &status, WNOHANG) != child) return 0;
+            close(progress_fd);
+            child = -1;
+            progress_fd = -1;
+            result = WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 1 : 0;
+        }
+#endif
+        if (writer.joinable()) {
+            progress = thread_progress.load(std::memory_order_relaxed);
+            result = thread_result.load();
+            if (result < 0) return 0;
+            writer.join();
+        }
+        progress = -1;
+        write_ms = double(now_ns() - start_ns) * 1e-6;
+        return result == 1 ? 1 : -1;
     }
+};
 
-    int& at(int x, int y) { x = (x % w + w) % w; y = (y % h + h) % h; return cells[y * w + x]; }
+// Счётчики производительности: пишутся потоками симуляции и отрисовки без блокировок,
+// читаются панелью производительности несколько раз в секунду
+struct PerfCounters {
+    std::atomic<uint64_t> generations{ 0 };
+    std::atomic<uint64_t> cell_updates{ 0 };
+    std::atomic<uint64_t> step_ns{ 0 };     // время пачек шагов (по часам)
+    std::atomic<uint64_t> render_ns{ 0 };   // подготовка и отрисовка кадра
+    std::atomic<uint64_t> frames{ 0 };
+    std::atomic<uint64_t> busy_ns[2]{};     // время работы потоков симуляции: 0 — основной (и потоки advance), 1 — поток варианта B
+    std::atomic<uint64_t> latency_ns{ 0 };  // задержка от обработки правки до показа кадра с ней (сумма)
+    std::atomic<uint64_t> latency_n{ 0 };
+    std::atomic<uint64_t> latency_max{ 0 }; // максимум с последнего снятия панелью
 
-    // Один шаг автомата
-    void step() {
-        std::vector<int> next = cells; // начнем с текущих значений
+    void add(std::atomic<uint64_t>& c, uint64_t v) { c.fetch_add(v, std::memory_order_relaxed); }
 
-        int ox = offset ? 1 : 0;
-        int oy = offset ? 1 : 0; // диагональное смещение (1,1), когда offset == true
+    void add_latency(uint64_t ns) {
+        add(latency_ns, ns);
+        add(latency_n, 1);
+        uint64_t m = latency_max.load(std::memory_order_relaxed);
+        while (ns > m && !latency_max.compare_exchange_weak(m, ns, std::memory_order_relaxed)) {}
+    }
+};
 
-        for (int by = oy; by < h + oy; by += 2) {
-            for (int bx = ox; bx < w + ox; bx += 2) {
-                // координаты левого верхнего угла блока (с учетом зацикливания)
-                int x0 = (bx) % w;
-                int y0 = (by) % h;
-                Block b{ at(x0,y0), at(x0 + 1,y0), at(x0,y0 + 1), at(x0 + 1,y0 + 1) };
+// Панель производительности: раз в PERIOD секунд снимает счётчики и пересчитывает скорости
+struct PerfHud {
+    static constexpr double PERIOD = 0.5;
+    bool visible = false;
+    uint64_t last_t = 0;
+    uint64_t last[8] = {};   // generations, cell_updates, step_ns, render_ns, frames, busy (сумма), latency_ns, latency_n
+    std::wstring text;
 
-                bool applied = false;
-                // попытка применить каждое правило
-                for (const auto& r : rules) {
-                    // прямое совпадение
-                    if (match_pattern(r.in, b)) {
-                        Block out = apply_output_template(r.out, b);
-                        next[y0 * w + x0] = out[0];
-                        next[y0 * w + ((x0 + 1) % w)] = out[1];
-                        next[((y0 + 1) % h) * w + x0] = out[2];
-                        next[((y0 + 1) % h) * w + ((x0 + 1) % w)] = out[3];
-                        applied = true;
-                        break;
-                    }
-                    // если правило симметрично — проверяем зеркальную копию
-                    if (r.horizontal_reflection) {
-                        Block mb = mirror_h(b);
-                        if (match_pattern(r.in, mb)) {
-                            Block mout = apply_output_template(r.out, mb);
-                            Block mirrored_back = mirror_h(mout);
-                            next[y0 * w + x0] = mirrored_back[0];
-                            next[y0 * w + ((x0 + 1) % w)] = mirrored_back[1];
-                            next[((y0 + 1) % h) * w + x0] = mirrored_back[2];
-                            next[((y0 + 1) % h) * w + ((x0 + 1) % w)] = mirrored_back[3];
-                            applied = true;
-                            break;
-                        }
-                    }
-                }
-                // если ни одно правило не подошло — блок остаётся без изменений
+    // Пора ли обновлять текст; дорогие аргументы sample() считаются только тогда
+    bool due() const { return last_t == 0 || double(now_ns() - last_t) >= PERIOD * 1e9; }
+
+    // Возвращает true, если текст обновился
+    bool sample(PerfCounters& pc, int threads, double active_tiles, size_t memory) {
+        uint64_t t = now_ns();
+        if (last_t != 0 && double(t - last_t) < PERIOD * 1e9) return false;
+        uint64_t cur[8] = {
+            pc.generations.load(std::memory_order_relaxed), pc.cell_updates.load(std::memory_order_relaxed),
+            pc.step_ns.load(std::memory_order_relaxed), pc.render_ns.load(std::memory_order_relaxed),
+            pc.frames.load(std::memory_order_relaxed),
+            pc.busy_ns[0].load(std::memory_order_relaxed) + pc.busy_ns[1].load(std::memory_order_relaxed),
+            pc.latency_ns.load(std::memory_order_relaxed), pc.latency_n.load(std::memory_order_relaxed) };
+        uint64_t lat_max = pc.latency_max.exchange(0, std::memory_order_relaxed);
+        double dt = last_t ? double(t - last_t) * 1e-9 : 0.0;
+        if (dt > 0) {
+            double gens = double(cur[0] - last[0]), frames = double(cur[4] - last[4]), inputs = double(cur[7] - last[7]);
+            wchar_t buf[512];
+            std::swprintf(buf, 512,
+                L"Поколений/с: %.0f   Обновлений ячеек/с: %.3g\n"
+                L"Шаг: %.3f мс   Отрисовка: %.2f мс/кадр\n"
+                L"Активные тайлы: %.1f%%   Память: %.1f МБ   Загрузка потоков: %.0f%% (%d)\n"
+                L"Задержка правки до показа: %.1f мс (макс. %.1f мс)",
+                gens / dt, double(cur[1] - last[1]) / dt,
+                gens > 0 ? double(cur[2] - last[2]) * 1e-6 / gens : 0.0,
+                frames > 0 ? double(cur[3] - last[3]) * 1e-6 / frames : 0.0,
+                active_tiles * 100.0, double(memory) / (1 << 20),
+                double(cur[5] - last[5]) * 1e-9 / (dt * threads) * 100.0, threads,
+                inputs > 0 ? double(cur[6] - last[6]) * 1e-6 / inputs : 0.0, double(lat_max) * 1e-6);
+            text = buf;
+        }
+        std::copy(cur, cur + 8, last);
+        last_t = t;
+        return dt > 0;
+    }
+};
+
+// Доля тайлов size×size, затронутых изменениями последнего шага
+double active_tile_share(const Margolus& s, int size = 8) {
+    int tx = (s.w + size - 1) / size, ty = (s.h + size - 1) / size;
+    if (tx * ty == 0) return 0.0;
+    std::vector<uint8_t> hit(size_t(tx) * ty, 0);
+    int n = 0;
+    for (int idx : s.changed) {
+        size_t t = size_t(idx / s.w / size) * tx + (idx % s.w) / size;
+        n += !hit[t];
+        hit[t] = 1;
+    }
+    return double(n) / (double(tx) * ty);
+}
+
+// Сокеты: общая часть для Windows (Winsock) и POSIX
+#ifdef _WIN32
+using socket_t = SOCKET;
+const socket_t BAD_SOCKET = INVALID_SOCKET;
+inline void close_socket(socket_t s) { closesocket(s); }
+#else
+using socket_t = int;
+const socket_t BAD_SOCKET = -1;
+inline void close_socket(socket_t s) { ::close(s); }
+#endif
+
+// Инициализация сетевой подсистемы (требуется только в Windows)
+inline bool net_init() {
+#ifdef _WIN32
+    static bool ok = [] { WSADATA d; return WSAStartup(MAKEWORD(2, 2), &d) == 0; }();
+    return ok;
+#else
+    return true;
+#endif
+}
+
+// Ожидание готовности сокета к чтению не дольше timeout_ms
+inline bool wait_readable(socket_t s, int timeout_ms) {
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(s, &set);
+    timeval tv{ timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    return select(int(s + 1), &set, nullptr, nullptr, &tv) > 0;
+}
+
+// Неблокирующий режим сокета: send() отдаёт сколько поместилось в буфер системы и не ждёт получателя
+inline void set_nonblocking(socket_t s) {
+#ifdef _WIN32
+    u_long yes = 1;
+    ioctlsocket(s, FIONBIO, &yes);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+// Последняя ошибка сокета — «буфер отправки полон», а не обрыв соединения
+inline bool would_block() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Метрики симуляции для мониторинга: записываются потоком симуляции, читаются сервером метрик.
+// Все поля атомарные, поток симуляции никогда не ждёт сервер.
+struct SimMetrics {
+    static const int BUCKETS = 8;
+    static constexpr double BUCKET_LE[BUCKETS] = { 1e-5, 1e-4, 5e-4, 1e-3, 5e-3, 1e-2, 0.1, 1.0 }; // границы, секунды
+    static constexpr int STATES = 16;
+
+    std::atomic<uint64_t> generation{ 0 };
+    std::atomic<uint64_t> steps{ 0 };
+    std::atomic<uint64_t> step_ns_sum{ 0 };
+    std::atomic<uint64_t> step_bucket[BUCKETS + 1]{};    // последний — больше всех границ
+    std::atomic<long long> population[STATES]{};
+    std::atomic<int> states{ TABLE_STATES };              // число состояний текущих правил
+    std::atomic<uint64_t> changed_blocks{ 0 }, total_blocks{ 0 }; // последний шаг
+    std::atomic<uint64_t> npy_queue{ 0 };                 // буферов в очереди записи .npy
+    std::atomic<uint64_t> memory_bytes{ 0 };
+
+    // Учёт одного шага длительностью ns
+    void record_step(const Margolus& s, uint64_t ns) {
+        const auto r = std::memory_order_relaxed;
+        generation.store(uint64_t(s.generation), r);
+        steps.fetch_add(1, r);
+        step_ns_sum.fetch_add(ns, r);
+        int b = 0;
+        while (b < BUCKETS && double(ns) * 1e-9 > BUCKET_LE[b]) ++b;
+        step_bucket[b].fetch_add(1, r);
+        states.store(int(s.population.size()), r);
+        for (int i = 0; i < STATES; ++i)
+            population[i].store(i < int(s.population.size()) ? s.population[i] : 0, r);
+        changed_blocks.store(s.changed.size(), r);
+        total_blocks.store(uint64_t(s.w / 2) * (s.h / 2), r);
+    }
+
+    // Текст в формате Prometheus; steps_per_sec считается сервером между опросами
+    std::string render(double steps_per_sec) const {
+        const auto r = std::memory_order_relaxed;
+        std::string o;
+        auto line = [&](const std::string& s) { o += s; o += '\n'; };
+        line("# HELP margolus_generation Номер текущего поколения.");
+        line("# TYPE margolus_generation counter");
+        line("margolus_generation " + std::to_string(generation.load(r)));
+        line("# HELP margolus_steps_per_second Скорость симуляции между двумя опросами.");
+        line("# TYPE margolus_steps_per_second gauge");
+        line("margolus_steps_per_second " + std::to_string(steps_per_sec));
+        line("# HELP margolus_step_seconds Длительность одного шага.");
+        line("# TYPE margolus_step_seconds histogram");
+        uint64_t cum = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            cum += step_bucket[b].load(r);
+            char le[32];
+            std::snprintf(le, sizeof(le), "%g", BUCKET_LE[b]);
+            line(std::string("margolus_step_seconds_bucket{le=\"") + le + "\"} " + std::to_string(cum));
+        }
+        cum += step_bucket[BUCKETS].load(r);
+        line("margolus_step_seconds_bucket{le=\"+Inf\"} " + std::to_string(cum));
+        line("margolus_step_seconds_sum " + std::to_string(double(step_ns_sum.load(r)) * 1e-9));
+        line("margolus_step_seconds_count " + std::to_string(steps.load(r)));
+        line("# HELP margolus_population Число ячеек в каждом состоянии.");
+        line("# TYPE margolus_population gauge");
+        for (int i = 0; i < std::min(states.load(r), STATES); ++i)
+            line("margolus_population{state=\"" + std::to_string(i) + "\"} " + std::to_string(population[i].load(r)));
+        uint64_t total = total_blocks.load(r);
+        line("# HELP margolus_changed_block_fraction Доля блоков 2x2, изменившихся на последнем шаге.");
+        line("# TYPE margolus_changed_block_fraction gauge");
+        line("margolus_changed_block_fraction " + std::to_string(total ? double(changed_blocks.load(r)) / double(total) : 0.0));
+        line("# HELP margolus_exporter_queue_depth Буферы, ожидающие записи экспортёрами.");
+        line("# TYPE margolus_exporter_queue_depth gauge");
+        line("margolus_exporter_queue_depth{exporter=\"npy\"} " + std::to_string(npy_queue.load(r)));
+        line("# HELP margolus_memory_bytes Память, занятая данными автомата.");
+        line("# TYPE margolus_memory_bytes gauge");
+        line("margolus_memory_bytes " + std::to_string(memory_bytes.load(r)));
+        return o;
+    }
+};
+constexpr double SimMetrics::BUCKET_LE[SimMetrics::BUCKETS];
+
+// Встроенный HTTP-сервер метрик на 127.0.0.1: на любой запрос отвечает текстом метрик
+struct MetricsServer {
+    const SimMetrics& metrics;
+    socket_t listener = BAD_SOCKET;
+    std::thread th;
+    std::atomic<bool> stop{ false };
+
+    explicit MetricsServer(const SimMetrics& m) : metrics(m) {}
+    ~MetricsServer() { shutdown(); }
+
+    bool start(int port) {
+        if (!net_init()) return false;
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == BAD_SOCKET) return false;
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+            close_socket(listener);
+            listener = BAD_SOCKET;
+            return false;
+        }
+        th = std::thread([this] { serve(); });
+        return true;
+    }
+
+    void serve() {
+        uint64_t last_t = now_ns(), last_steps = metrics.steps.load();
+        double rate = 0.0;
+        while (!stop) {
+            if (!wait_readable(listener, 200)) continue;
+            socket_t c = accept(listener, nullptr, nullptr);
+            if (c == BAD_SOCKET) continue;
+            char req[1024];
+            if (wait_readable(c, 1000)) recv(c, req, sizeof(req), 0); // содержимое запроса не важно
+            uint64_t t = now_ns(), st = metrics.steps.load(std::memory_order_relaxed);
+            if (t > last_t) rate = double(st - last_steps) * 1e9 / double(t - last_t);
+            last_t = t; last_steps = st;
+            std::string body = metrics.render(rate);
+            std::string resp = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            size_t sent = 0;
+            while (sent < resp.size()) {
+                int n = int(send(c, resp.data() + sent, int(resp.size() - sent), 0));
+                if (n <= 0) break;
+                sent += size_t(n);
             }
+            close_socket(c);
         }
+    }
 
-        cells.swap(next);
-        offset = !offset;
+    void shutdown() {
+        stop = true;
+        if (th.joinable()) th.join();
+        if (listener != BAD_SOCKET) close_socket(listener);
+        listener = BAD_SOCKET;
+    }
+};
+
+// Хеш сетки для проверки синхронизации участников
+uint64_t grid_hash(const Margolus& sim) {
+    uint64_t h = mix64((uint64_t(uint32_t(sim.w)) << 32 | uint32_t(sim.h)) ^ uint64_t(sim.offset));
+    size_t n = sim.cells.size(), i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, &sim.cells[i], 8);
+        h = mix64(h ^ v);
+    }
+    for (; i < n; ++i) h = mix64(h ^ sim.cells[i]);
+    return h;
+}
+
+inline uint64_t zigzag(int v) { return v < 0 ? (uint64_t(-int64_t(v)) << 1) - 1 : uint64_t(v) << 1; }
+inline int unzigzag(uint64_t z) { return (z & 1) ? int(-int64_t(z >> 1) - 1) : int(z >> 1); }
+
+// Команда редактирования в сети: тип, координаты и состояние переменной длины; для вставки —
+// размеры и сжатые ячейки фрагмента. Мазок кистью занимает 4–6 байт при любом размере поля.
+void put_edit(std::vector<uint8_t>& v, const EditCommand& c) {
+    v.push_back(uint8_t(c.type));
+    put_varint(v, zigzag(c.x));
+    put_varint(v, zigzag(c.y));
+    put_varint(v, uint64_t(uint32_t(c.state)));
+    if (c.type != EditCommand::Paste) return;
+    Region empty;
+    const Region& r = c.region ? *c.region : empty;
+    std::vector<uint8_t> packed;
+    rle_compress(r.cells.data(), r.cells.size(), packed);
+    put_varint(v, uint64_t(r.w));
+    put_varint(v, uint64_t(r.h));
+    put_varint(v, packed.size());
+    v.insert(v.end(), packed.begin(), packed.end());
+}
+
+bool get_edit(const std::vector<uint8_t>& v, size_t& i, EditCommand& c) {
+    uint64_t x, y, st;
+    if (i >= v.size() || v[i] > EditCommand::Rules) return false;
+    c.type = EditCommand::Type(v[i++]);
+    if (!get_varint(v, i, x) || !get_varint(v, i, y) || !get_varint(v, i, st)) return false;
+    c.x = unzigzag(x); c.y = unzigzag(y); c.state = int(uint32_t(st));
+    if (c.type != EditCommand::Paste) return true;
+    uint64_t w, h, n;
+    if (!get_varint(v, i, w) || !get_varint(v, i, h) || !get_varint(v, i, n) || n > v.size() - i
+        || w == 0 || h == 0 || w > uint64_t(INT32_MAX) || h > uint64_t(INT32_MAX) || w * h > uint64_t(INT32_MAX))
+        return false;
+    auto r = std::make_shared<Region>();
+    if (!rle_decompress(v.data() + i, size_t(n), r->cells, size_t(w * h)) || r->cells.size() != w * h) return false;
+    r->w = int(w); r->h = int(h);
+    i += size_t(n);
+    c.region = r;
+    return true;
+}
+
+// Совместное редактирование в режиме lockstep. Каждый участник считает свой автомат; по сети идут только
+// команды редактирования с номером поколения, в котором их нужно применить.
+// Ведущий (--host PORT) задаёт темп: свои команды и команды участников он применяет в текущем поколении
+// и рассылает с этим номером, а после шагов рассылает границу — поколение, до которого участникам
+// (--join PORT) разрешено считать. TCP сохраняет порядок, поэтому все команды поколения G приходят
+// раньше границы больше G, и участник применяет их перед шагом из G — как и ведущий.
+// Новый участник один раз получает снимок состояния; каждые HASH_EVERY поколений стороны обмениваются
+// хешами сетки, расхождение запоминается в desync_gen.
+struct Lockstep {
+    enum Role { Off, Host, Client };
+    enum Msg : uint8_t { MsgEdit = 1, MsgStamped, MsgFrontier, MsgHash, MsgSnapshot };
+    static const int HASH_EVERY = 64;
+
+    struct Peer {
+        socket_t s = BAD_SOCKET;
+        std::vector<uint8_t> in;  // принятые, ещё не разобранные байты
+        std::vector<uint8_t> out; // ещё не отправленные байты (сокет неблокирующий)
+        bool bad = false;         // нарушил протокол или не успевает принимать — отключается в poll()
+    };
+
+    Role role = Off;
+    socket_t listener = BAD_SOCKET;
+    std::vector<Peer> peers;   // у ведущего — участники, у участника — ведущий
+    std::vector<std::pair<long long, EditCommand>> pending; // участник: команды, ждущие своего поколения
+    long long frontier = 0;    // участник: граница, до которой разрешено считать
+    long long sent_frontier = -1;
+    bool synced = false;       // участник получил снимок
+    int rules_id = 0;          // текущий набор правил (передаётся в снимке)
+    std::unordered_map<long long, uint64_t> mine, theirs; // хеши своих и чужих поколений
+    long long desync_gen = -1;
+    uint64_t bytes_sent = 0, bytes_received = 0;
+
+    ~Lockstep() {
+        for (auto& p : peers) close_socket(p.s);
+        if (listener != BAD_SOCKET) close_socket(listener);
+    }
+
+    static void no_delay(socket_t s) {
+        int yes = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+    }
+
+    bool host(int port) {
+        if (!net_init()) return false;
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == BAD_SOCKET) return false;
+        int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 8) != 0) {
+            close_socket(listener);
+            listener = BAD_SOCKET;
+            return false;
+        }
+        role = Host;
+        return true;
+    }
+
+    bool join(int port) {
+        if (!net_init()) return false;
+        socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == BAD_SOCKET) return false;
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(uint16_t(port));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            close_socket(s);
+            return false;
+        }
+        no_delay(s);
+        set_nonblocking(s);
+        peers.push_back(Peer{ s, {}, {}, false });
+        role = Client;
+        return true;
+    }
+
+    static constexpr size_t MAX_SEND_BACKLOG = size_t(64) << 20; // неотправленных байт на участника
+
+    // Наибольшее сообщение: снимок или фрагмент во всё поле
+    static size_t max_msg(const Margolus& sim) { return rle_bound(size_t(sim.w) * size_t(sim.h)) + 64; }
+
+    // Сообщение: тип, длина (varint), содержимое. Ставится в очередь участника и отправляется, сколько
+    // примет система; остаток дописывается из poll(). Поток интерфейса не ждёт медленного участника:
+    // если очередь переросла MAX_SEND_BACKLOG, участник отключается.
+    void send_msg(Peer& p, Msg type, const std::vector<uint8_t>& body) {
+        p.out.push_back(uint8_t(type));
+        put_varint(p.out, body.size());
+        p.out.insert(p.out.end(), body.begin(), body.end());
+        flush(p);
+    }
+
+    void flush(Peer& p) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL; // обрыв соединения — ошибка send(), а не SIGPIPE
+#else
+        const int flags = 0;
+#endif
+        size_t sent = 0;
+        while (!p.bad && sent < p.out.size()) {
+            int n = int(send(p.s, (const char*)p.out.data() + sent, int(std::min<size_t>(p.out.size() - sent, 1 << 20)), flags));
+            if (n > 0) sent += size_t(n);
+            else if (n < 0 && would_block()) break;
+            else p.bad = true;
+        }
+        p.out.erase(p.out.begin(), p.out.begin() + sent);
+        bytes_sent += sent;
+        if (p.out.size() > MAX_SEND_BACKLOG) p.bad = true;
+    }
+
+    void broadcast(Msg type, const std::vector<uint8_t>& body) {
+        for (auto& p : peers) send_msg(p, type, body);
+    }
+
+    // Разрешённое число шагов до границы (ведущий и одиночный режим не ограничены)
+    long long allowed(const Margolus& sim) const {
+        if (role != Client) return (std::numeric_limits<long long>::max)();
+        return synced ? std::max(0LL, frontier - sim.generation) : 0;
+    }
+
+    // Локальная правка. Возвращает true, если её нужно применить сразу (одиночный режим и ведущий);
+    // участник только отправляет её ведущему и применит, когда она вернётся с номером поколения.
+    bool submit(const Margolus& sim, const EditCommand& c) {
+        if (role == Off) return true;
+        std::vector<uint8_t> body;
+        if (role == Client) {
+            put_edit(body, c);
+            if (!peers.empty()) send_msg(peers[0], MsgEdit, body);
+            return false;
+        }
+        put_varint(body, uint64_t(sim.generation));
+        put_edit(body, c);
+        broadcast(MsgStamped, body);
+        if (c.type == EditCommand::Rules) rules_id = c.state;
+        return true;
+    }
+
+    // Применение команд участника, назначенных на текущее или более раннее поколение
+    template <class Apply> void apply_due(const Margolus& sim, Apply&& apply) {
+        size_t n = 0;
+        while (n < pending.size() && pending[n].first <= sim.generation) {
+            if (pending[n].second.type == EditCommand::Rules) rules_id = pending[n].second.state;
+            apply(pending[n].second);
+            ++n;
+        }
+        pending.erase(pending.begin(), pending.begin() + n);
     }
 
-    void clear() { std::fill(cells.begin(), cells.end(), 0); }
+    // После шага: обмен хешами каждые HASH_EVERY поколений
+    void after_step(const Margolus& sim) {
+        if (role == Off || sim.generation % HASH_EVERY != 0) return;
+        uint64_t h = grid_hash(sim);
+        mine[sim.generation] = h;
+        auto it = theirs.find(sim.generation);
+        if (it != theirs.end()) {
+            if (it->second != h) report_desync(sim.generation);
+            theirs.erase(it);
+        }
+        std::vector<uint8_t> body;
+        put_varint(body, uint64_t(sim.generation));
+        put_varint(body, h);
+        broadcast(MsgHash, body);
+        long long old = sim.generation - 16LL * HASH_EVERY;
+        for (auto m = mine.begin(); m != mine.end();) m = m->first < old ? mine.erase(m) : std::next(m);
+    }
+
+    // После пачки шагов ведущий рассылает новую границу
+    void end_batch(const Margolus& sim) {
+        if (role != Host || sim.generation == sent_frontier) return;
+        std::vector<uint8_t> body;
+        put_varint(body, uint64_t(sim.generation));
+        broadcast(MsgFrontier, body);
+        sent_frontier = sim.generation;
+    }
+
+    void report_desync(long long gen) {
+        if (desync_gen < 0) std::cerr << "рассинхронизация: хеш сетки поколения " << gen << " не совпал\n";
+        desync_gen = gen;
+    }
+
+    // Приём: новые участники, команды, границы, хеши и снимок. apply(c) применяет команду к автомату;
+    // возвращает true, если состояние целиком заменено снимком.
+    template <class Apply> bool poll(Margolus& sim, Apply&& apply) {
+        bool replaced = false;
+        if (role == Off) return false;
+        while (role == Host && wait_readable(listener, 0)) {
+            socket_t c = accept(listener, nullptr, nullptr);
+            if (c == BAD_SOCKET) break;
+            no_delay(c);
+            set_nonblocking(c);
+            peers.push_back(Peer{ c, {}, {}, false });
+            std::vector<uint8_t> body, packed;
+            put_varint(body, uint64_t(sim.generation));
+            put_varint(body, sim.offset ? 1 : 0);
+            put_varint(body, uint64_t(rules_id));
+            put_varint(body, uint64_t(sim.w));
+            put_varint(body, uint64_t(sim.h));
+            rle_compress(sim.cells.data(), sim.cells.size(), packed);
+            body.insert(body.end(), packed.begin(), packed.end());
+            send_msg(peers.back(), MsgSnapshot, body);
+            body.clear();
+            put_varint(body, uint64_t(sim.generation));
+            send_msg(peers.back(), MsgFrontier, body);
+        }
+        for (size_t pi = 0; pi < peers.size();) {
+            Peer& p = peers[pi];
+            bool closed = false;
+            while (wait_readable(p.s, 0)) {
+                char buf[65536];
+                int n = int(recv(p.s, buf, sizeof(buf), 0));
+                if (n < 0 && would_block()) break;
+                if (n <= 0) { closed = true; break; }
+                p.in.insert(p.in.end(), buf, buf + n);
+                bytes_received += size_t(n);
+            }
+            size_t i = 0;
+            while (i < p.in.size() && !p.bad) {
+                size_t j = i + 1;
+                uint64_t len;
+                if (!get_varint(p.in, j, len)) break;
+                if (len > max_msg(sim)) { p.bad = true; break; }
+                if (len > p.in.size() - j) break; // сообщение ещё не пришло целиком
+                std::vector<uint8_t> body(p.in.begin() + j, p.in.begin() + j + size_t(len));
+                replaced |= handle(sim, Msg(p.in[i]), body, apply, p.bad);
+                i = j + size_t(len);
+            }
+            p.in.erase(p.in.begin(), p.in.begin() + i);
+            flush(p);
+            if (closed || p.bad) {
+                if (p.bad) std::cerr << (role == Client ? "ведущий" : "участник") << " отключён: ошибка протокола или переполнена очередь отправки\n";
+                close_socket(p.s);
+                peers.erase(peers.begin() + pi);
+                if (role == Client) std::cerr << "соединение с ведущим потеряно\n";
+            }
+            else ++pi;
+        }
+        if (role == Client) apply_due(sim, apply);
+        return replaced;
+    }
 
-    void randomize(double fill_prob = 0.12) {
-        std::mt19937 rng(12345);
-        std::uniform_real_distribution<double> d(0, 1);
-        for (int i = 0; i < w * h; ++i) cells[i] = d(rng) < fill_prob ? 1 : 0;
+    // Разбор сообщения; bad — сообщение испорчено или команда не проходит valid_edit (участник отключается).
+    // Ведущий проверяет команды по текущему набору правил; участник — только по MAX_TABLE_STATES,
+    // потому что смена правил перед командой может ещё ждать своего поколения в pending.
+    template <class Apply> bool handle(Margolus& sim, Msg type, const std::vector<uint8_t>& b, Apply&& apply, bool& bad) {
+        size_t i = 0;
+        uint64_t a, c;
+        EditCommand cmd;
+        if (type == MsgEdit && role == Host) {
+            if (!get_edit(b, i, cmd) || !valid_edit(sim, cmd, std::max(TABLE_STATES, rules_table_states(sim.rules)))) bad = true;
+            else if (submit(sim, cmd)) apply(cmd);
+        }
+        else if (type == MsgStamped && role == Client) {
+            if (!get_varint(b, i, a) || !get_edit(b, i, cmd) || !valid_edit(sim, cmd, MAX_TABLE_STATES)) bad = true;
+            else pending.push_back({ (long long)a, cmd });
+        }
+        else if (type == MsgFrontier && role == Client && get_varint(b, i, a)) frontier = (long long)a;
+        else if (type == MsgHash && get_varint(b, i, a) && get_varint(b, i, c)) {
+            auto it = mine.find((long long)a);
+            if (it != mine.end()) { if (it->second != c) report_desync((long long)a); }
+            else if ((long long)a > sim.generation) theirs[(long long)a] = c;
+        }
+        else if (type == MsgSnapshot && role == Client) {
+            uint64_t gen, off, rid, w, h;
+            std::vector<uint8_t> cells;
+            if (!get_varint(b, i, gen) || !get_varint(b, i, off) || !get_varint(b, i, rid) || !get_varint(b, i, w)
+                || !get_varint(b, i, h) || w != uint64_t(sim.w) || h != uint64_t(sim.h) || rid >= uint64_t(RULE_SETS)
+                || !rle_decompress(b.data() + i, b.size() - i, cells, sim.cells.size()) || cells.size() != sim.cells.size()
+                || !valid_states(cells)) {
+                std::cerr << "снимок ведущего не подходит к этому полю\n";
+                bad = true;
+                return false;
+            }
+            rules_id = int(rid);
+            sim.set_rules(rule_set(rules_id));
+            sim.cells.swap(cells);
+            sim.generation = (long long)gen;
+            sim.offset = off != 0;
+            sim.rebuild_stats();
+            if (sim.track_ids) sim.enable_ids(true);
+            synced = true;
+            return true;
+        }
+        return false;
     }
 };
 
-// Цвета для состояний: 0 — пусто, 1 — песок, 2 — твёрдая поверхность, 3 — источник
+// Цвета для состояний: 0 — пусто, 1 — песок, 2 — твёрдая поверхность, 3 — источник, 4 — вода, 5 — масло
 sf::Color color_for_state(int s) {
     switch (s) {
     case 0: return sf::Color(20, 20, 20); // почти чёрный
     case 1: return sf::Color(212, 175, 55); // песочный
     case 2: return sf::Color(100, 40, 20); // грунт
     case 3: return sf::Color(230, 230, 230); // источник
+    case 4: return sf::Color(40, 90, 200); // вода
+    case 5: return sf::Color(120, 80, 30); // масло
     default: return sf::Color::Magenta;
     }
 }
 
-int main() {
+// Параметры консольного режима (без окна)
+struct HeadlessOptions {
+    long long steps = 1000;   // число шагов
+    int every = 0;            // печатать профиль поверхности каждые N шагов (0 — только в конце)
+    int w = GRID_W, h = GRID_H;
+    double fill = 0.09;
+    int trace = 0;            // число отслеживаемых зёрен (траектории печатаются в конце)
+    std::vector<std::array<int, 4>> probes; // зонды потока: {горизонтальный?, pos, from, to}
+    std::string flux_csv;     // файл для временных рядов потока
+    std::string npy;          // файл траектории .npy
+    int npy_every = 1;        // записывать каждое N-е поколение
+    bool npy_packed = false;  // упаковка 4 ячеек в байт
+    bool verify = false;      // перечитать записанные файлы в конце прогона
+    std::string archive;      // файл сжатого архива траектории
+    int archive_k = 256;      // интервал ключевых кадров
+    int metrics_port = 0;     // порт сервера метрик на 127.0.0.1 (0 — выключен)
+    std::string load;         // начальное состояние из контрольной точки
+    std::string save;         // контрольная точка в конце
+    int checkpoint_every = 0; // фоновые контрольные точки каждые N шагов (в файл --save или checkpoint.msc)
+    long long generate = -1;  // seed процедурного мира (-1 — случайное заполнение песком)
+    int threads = 0;          // потоков генерации (0 — по числу ядер)
+    int layout = 0;           // раскладка сетки для пачек шагов (Margolus::layout)
+    bool materials = false;   // правила из материалов (build_material_rules)
+    long long avalanche = 0;  // число возмущений в пакетном анализе лавин (0 — обычный прогон)
+    uint64_t avalanche_seed = 1;
+    std::string avalanche_csv; // файл с параметрами каждой лавины
+    std::vector<std::array<int, 4>> counts; // прямоугольники {x0, y0, x1, y1} для подсчёта песка
+    int depth = 0;            // глубина трёхмерного автомата (0 — двумерный режим)
+    char slice_axis = 'z';    // ось срезов 3D
+    int slice_pos = -1;       // координата среза (-1 — середина)
+    std::string slice_prefix; // префикс файлов срезов .ppm
+};
+
+// Разбор аргументов командной строки; возвращает false, если консольный режим не запрошен
+bool parse_headless(int argc, char** argv, HeadlessOptions& opt) {
+    bool headless = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--headless") {
+            headless = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') opt.steps = std::atoll(argv[++i]);
+        }
+        else if (a == "--every" && i + 1 < argc) opt.every = std::atoi(argv[++i]);
+        else if (a == "--size" && i + 2 < argc) {
+            opt.w = std::atoi(argv[++i]) & ~1;
+            opt.h = std::atoi(argv[++i]) & ~1;
+        }
+        else if (a == "--fill" && i + 1 < argc) opt.fill = std::atof(argv[++i]);
+        else if (a == "--trace" && i + 1 < argc) opt.trace = std::atoi(argv[++i]);
+        else if (a == "--probe" && i + 4 < argc) {
+            bool hor = argv[++i][0] == 'h';
+            int pos = std::atoi(argv[++i]);
+            int from = std::atoi(argv[++i]);
+            int to = std::atoi(argv[++i]);
+            opt.probes.push_back({ hor ? 1 : 0, pos, from, to });
+        }
+        else if (a == "--flux-csv" && i + 1 < argc) opt.flux_csv = argv[++i];
+        else if (a == "--npy" && i + 1 < argc) opt.npy = argv[++i];
+        else if (a == "--npy-every" && i + 1 < argc) opt.npy_every = std::atoi(argv[++i]);
+        else if (a == "--npy-packed") opt.npy_packed = true;
+        else if (a == "--verify") opt.verify = true;
+        else if (a == "--archive" && i + 1 < argc) opt.archive = argv[++i];
+        else if (a == "--archive-k" && i + 1 < argc) opt.archive_k = std::atoi(argv[++i]);
+        else if (a == "--metrics-port" && i + 1 < argc) opt.metrics_port = std::atoi(argv[++i]);
+        else if (a == "--load" && i + 1 < argc) opt.load = argv[++i];
+        else if (a == "--save" && i + 1 < argc) opt.save = argv[++i];
+        else if (a == "--checkpoint-every" && i + 1 < argc) opt.checkpoint_every = std::atoi(argv[++i]);
+        else if (a == "--generate" && i + 1 < argc) opt.generate = std::atoll(argv[++i]);
+        else if (a == "--threads" && i + 1 < argc) opt.threads = std::atoi(argv[++i]);
+        else if (a == "--morton") opt.layout = std::max(opt.layout, 1);
+        else if (a == "--morton-cells") opt.layout = 2;
+        else if (a == "--materials") opt.materials = true;
+        else if (a == "--avalanche" && i + 1 < argc) {
+            opt.avalanche = std::atoll(argv[++i]);
+            if (i + 1 < argc && argv[i + 1][0] != '-') opt.avalanche_seed = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (a == "--avalanche-csv" && i + 1 < argc) opt.avalanche_csv = argv[++i];
+        else if (a == "--count" && i + 4 < argc) {
+            std::array<int, 4> r;
+            for (int& v : r) v = std::atoi(argv[++i]);
+            opt.counts.push_back(r);
+        }
+        else if (a == "--3d" && i + 1 < argc) opt.depth = std::atoi(argv[++i]) & ~1;
+        else if (a == "--slice" && i + 3 < argc) {
+            opt.slice_axis = argv[++i][0];
+            opt.slice_pos = std::atoi(argv[++i]);
+            opt.slice_prefix = argv[++i];
+        }
+    }
+    return headless;
+}
+
+// Вывод профиля поверхности: номер поколения и высоты всех столбцов
+void print_surface(const Margolus& sim, long long gen) {
+    std::cout << "gen " << gen << " surface";
+    for (int x = 0; x < sim.w; ++x) std::cout << ' ' << sim.surface_height(x);
+    std::cout << '\n';
+}
+
+// Экспорт временных рядов зондов потока в CSV: поколение (sim.generation после шага) и поток через каждый зонд
+// Заголовок пишется при открытии, накопленные строки дописываются flush_flux_csv, после чего ряды очищаются
+bool open_flux_csv(const Margolus& sim, const std::string& path, std::ofstream& f) {
+    f.open(path);
+    if (!f) return false;
+    f << "gen";
+    for (size_t i = 0; i < sim.probes.size(); ++i) f << ",probe" << i;
+    f << '\n';
+    return bool(f);
+}
+
+bool flush_flux_csv(Margolus& sim, std::ofstream& f) {
+    size_t n = sim.probes.empty() ? 0 : sim.probes[0].series.size();
+    for (size_t g = 0; g < n; ++g) {
+        f << sim.probes[0].series_first + (long long)g + 1;
+        for (const auto& p : sim.probes) f << ',' << p.series[g];
+        f << '\n';
+    }
+    for (auto& p : sim.probes) {
+        p.series_first += (long long)p.series.size();
+        p.series.clear();
+    }
+    return bool(f);
+}
+
+// Запись среза в двоичный PPM теми же цветами, что и в окне
+bool write_slice_ppm(const std::string& path, const std::vector<Cell>& s, int sw, int sh) {
+    std::ofstream f(path, std::ios::binary);
+    if (!f) return false;
+    f << "P6\n" << sw << ' ' << sh << "\n255\n";
+    std::vector<unsigned char> rgb(s.size() * 3);
+    for (size_t i = 0; i < s.size(); ++i) {
+        sf::Color c = color_for_state(s[i]);
+        rgb[3 * i] = c.r; rgb[3 * i + 1] = c.g; rgb[3 * i + 2] = c.b;
+    }
+    f.write(reinterpret_cast<const char*>(rgb.data()), std::streamsize(rgb.size()));
+    return bool(f);
+}
+
+// Остановка бесконечного консольного прогона (--headless 0) по SIGINT / SIGTERM:
+// цикл завершается, файлы .npy, архива и контрольной точки дописываются как обычно
+volatile std::sig_atomic_t headless_stop = 0;
+
+void request_headless_stop(int) { headless_stop = 1; }
+
+void install_headless_stop() {
+    std::signal(SIGINT, request_headless_stop);
+    std::signal(SIGTERM, request_headless_stop);
+}
+
+// Консольный режим 3D: ./margolus --headless 1000 --3d 64 --size 64 64 [--fill 0.09] [--every 100]
+//                      [--slice x|y|z K prefix] [--threads N]
+// Печатает число зёрен и скорость; срезы пишутся в prefix_<поколение>.ppm каждые --every шагов и в конце.
+int run_headless_3d(const HeadlessOptions& opt) {
+    Margolus3D sim(opt.w, opt.h, opt.depth);
+    if (opt.threads > 0) sim.threads = opt.threads;
+    sim.randomize(opt.fill);
+    int limit = opt.slice_axis == 'x' ? sim.w : opt.slice_axis == 'y' ? sim.h : sim.d;
+    int k = opt.slice_pos < 0 ? limit / 2 : std::min(opt.slice_pos, limit - 1);
+    auto report = [&]() {
+        long long sand = std::count(sim.cells.begin(), sim.cells.end(), Cell(1));
+        std::cout << "gen " << sim.generation << " sand " << sand << '\n';
+        if (opt.slice_prefix.empty()) return true;
+        int sw, sh;
+        std::vector<Cell> s = sim.slice(opt.slice_axis, k, sw, sh);
+        return write_slice_ppm(opt.slice_prefix + "_" + std::to_string(sim.generation) + ".ppm", s, sw, sh);
+    };
+    uint64_t t0 = now_ns();
+    if (opt.steps <= 0) install_headless_stop();
+    for (long long g = 1; opt.steps <= 0 ? !headless_stop : g <= opt.steps; ++g) {
+        // пачки до ближайшего среза; ограничены, чтобы Ctrl+C не ждал долго
+        const long long MAX_BATCH = 64;
+        long long n = opt.steps > 0 ? std::min(MAX_BATCH, opt.steps - g + 1) : MAX_BATCH;
+        if (opt.every > 0) n = std::min(n, opt.every - (g - 1) % opt.every);
+        sim.advance(n);
+        g += n - 1;
+        if (opt.every > 0 && g % opt.every == 0 && !report()) {
+            std::cerr << "ошибка записи среза " << opt.slice_prefix << '\n';
+            return 1;
+        }
+    }
+    double sec = double(now_ns() - t0) * 1e-9;
+    const long long done = sim.generation; // при --headless 0 — сколько успели до остановки
+    if ((opt.every <= 0 || done % opt.every != 0) && !report()) {
+        std::cerr << "ошибка записи среза " << opt.slice_prefix << '\n';
+        return 1;
+    }
+    std::cerr << sim.w << "x" << sim.h << "x" << sim.d << ": " << done << " шагов за " << sec << " с ("
+        << double(sim.cells.size()) * double(done) / std::max(sec, 1e-9) * 1e-6 << " Мячеек/с)\n";
+    return 0;
+}
+
+// Пакетный анализ лавин: зёрна по одному кладутся на поверхность случайных столбцов, после каждого
+// автомат доводится до затишья. Без --load / --generate начинает с пустого поля с грунтом в нижней строке.
+int run_avalanches(Margolus& sim, const HeadlessOptions& opt, bool fresh) {
+    if (fresh) {
+        sim.clear();
+        for (int x = 0; x < sim.w; ++x) sim.set(x, sim.h - 1, 2);
+    }
+    // источники (состояние 3) из --generate или --load не дали бы полю затихнуть: каждый эпизод
+    // упирался бы в предел шагов, поэтому в анализе лавин они убираются
+    if (sim.population.size() > 3 && sim.population[3] > 0) {
+        std::cerr << "источников убрано: " << sim.population[3] << '\n';
+        for (int i = 0; i < sim.w * sim.h; ++i)
+            if (sim.cells[i] == 3) sim.set(i % sim.w, i / sim.w, 0);
+    }
+    AvalancheAnalyzer an;
+    an.relax(sim);
+    std::ofstream csv;
+    if (!opt.avalanche_csv.empty()) {
+        csv.open(opt.avalanche_csv);
+        if (!csv) {
+            std::cerr << "не удалось открыть " << opt.avalanche_csv << '\n';
+            return 1;
+        }
+        csv << "event,x,size,duration,area,truncated\n";
+    }
+    uint64_t t0 = now_ns();
+    long long gen0 = sim.generation;
+    for (long long i = 0; i < opt.avalanche; ++i) {
+        int x = int(counter_random(opt.avalanche_seed, 0, uint32_t(i), uint32_t(i >> 32)) % uint64_t(sim.w));
+        AvalancheAnalyzer::Episode e;
+        if (!an.perturb(sim, x, e)) {
+            std::cerr << "столбец " << x << " заполнен, анализ остановлен после " << i << " возмущений\n";
+            break;
+        }
+        if (csv) csv << i << ',' << x << ',' << e.size << ',' << e.duration << ',' << e.area << ',' << int(e.truncated) << '\n';
+    }
+    double sec = double(now_ns() - t0) * 1e-9;
+    std::cout << "avalanche events " << an.events << " silent " << an.silent << " truncated " << an.truncated << '\n';
+    const std::pair<const char*, const LogHistogram*> hists[] = { { "size", &an.size }, { "duration", &an.duration }, { "area", &an.area } };
+    for (const auto& hp : hists) {
+        const LogHistogram& hg = *hp.second;
+        std::cout << "avalanche " << hp.first << " mean " << (hg.count ? hg.sum / double(hg.count) : 0.0) << " max " << hg.max << '\n';
+        for (int k = 0; hg.count && k <= hg.top_bin(); ++k)
+            std::cout << "avalanche " << hp.first << " bin " << (1LL << k) << ' ' << hg.bins[k] << '\n';
+    }
+    std::cerr << an.events << " возмущений, " << sim.generation - gen0 << " шагов за " << sec << " с\n";
+    if (!opt.save.empty() && !save_checkpoint(sim, opt.save)) {
+        std::cerr << "ошибка записи " << opt.save << '\n';
+        return 1;
+    }
+    return csv.is_open() && !csv ? 1 : 0;
+}
+
+// Консольный режим: ./margolus --headless 1000 [--every 100] [--size 320 240] [--fill 0.09] [--trace 10]
+//                   [--probe h|v pos from to]... [--flux-csv flux.csv] [--npy run.npy [--npy-every N] [--npy-packed]]
+//                   [--archive run.msa [--archive-k 256]] [--metrics-port 9100] [--load in.msc] [--save out.msc]
+//                   [--generate SEED] [--threads N] [--materials] [--avalanche N [SEED] [--avalanche-csv FILE]]
+//                   [--count X0 Y0 X1 Y1]...
+// При N <= 0 симуляция идёт до остановки процесса (режим службы).
+int run_headless(const HeadlessOptions& opt) {
+    if (opt.depth > 0) return run_headless_3d(opt);
+    HeadlessOptions o = opt;
+    std::vector<Cell> loaded;
+    long long loaded_gen = 0;
+    bool loaded_offset = false;
+    if (!opt.load.empty() && !load_checkpoint(opt.load, o.w, o.h, loaded_gen, loaded_offset, loaded)) {
+        std::cerr << "не удалось прочитать " << opt.load << '\n';
+        return 1;
+    }
+    Margolus sim(o.w, o.h);
+    if (opt.materials) sim.set_rules(build_material_rules(default_materials()));
+    if (opt.generate >= 0 && loaded.empty()) {
+        WorldGenParams gp;
+        gp.seed = uint64_t(opt.generate);
+        uint64_t t0 = now_ns();
+        generate_world(sim, gp, opt.threads > 0 ? opt.threads : default_threads());
+        std::cerr << "мир " << sim.w << "x" << sim.h << " сгенерирован за " << double(now_ns() - t0) * 1e-6 << " мс\n";
+    }
+    else if (loaded.empty()) sim.randomize(opt.fill);
+    else {
+        sim.cells.swap(loaded);
+        sim.generation = loaded_gen;
+        sim.offset = loaded_offset;
+        sim.rebuild_stats();
+    }
+    if (opt.avalanche > 0) return run_avalanches(sim, opt, loaded.empty() && opt.generate < 0);
+    for (const auto& p : opt.probes) sim.add_probe(p[0] != 0, p[1], p[2], p[3]);
+    if (!opt.counts.empty()) sim.enable_area_sums(1);
+    auto report = [&]() {
+        print_surface(sim, sim.generation);
+        for (size_t i = 0; i < opt.counts.size(); ++i) {
+            const auto& r = opt.counts[i];
+            std::cout << "gen " << sim.generation << " count " << i << ' ' << sim.count_in_rect(1, r[0], r[1], r[2], r[3]) << '\n';
+        }
+    };
+    // Ряды потока дописываются в CSV порциями, чтобы память не росла с длиной прогона
+    std::ofstream flux;
+    if (!opt.flux_csv.empty() && !open_flux_csv(sim, opt.flux_csv, flux)) {
+        std::cerr << "не удалось записать " << opt.flux_csv << '\n';
+        return 1;
+    }
+    auto flush_flux = [&](bool all) {
+        if (flux.is_open() && !sim.probes.empty() && (all || sim.probes[0].series.size() >= 4096)) flush_flux_csv(sim, flux);
+    };
+    NpyTrajectoryWriter npy;
+    if (!opt.npy.empty()) {
+        if (!npy.open(opt.npy, sim.w, sim.h, opt.npy_packed, opt.npy_every)) {
+            std::cerr << "не удалось открыть " << opt.npy << '\n';
+            return 1;
+        }
+        npy.push(sim);
+    }
+    SimMetrics metrics;
+    MetricsServer metrics_server(metrics);
+    metrics.states = int(sim.population.size());
+    if (opt.metrics_port > 0 && !metrics_server.start(opt.metrics_port)) {
+        std::cerr << "не удалось открыть порт метрик " << opt.metrics_port << '\n';
+        return 1;
+    }
+    TrajectoryArchiveWriter archive;
+    if (!opt.archive.empty()) {
+        if (!archive.open(opt.archive, sim.w, sim.h, opt.archive_k)) {
+            std::cerr << "не удалось открыть " << opt.archive << '\n';
+            return 1;
+        }
+        archive.push(sim);
+    }
+    if (opt.trace > 0) {
+        sim.enable_ids(true);
+        int traced = 0;
+        for (int i = 0; i < sim.w * sim.h && traced < opt.trace; ++i)
+            if (sim.cells[i] == 1 && sim.trace(i % sim.w, i / sim.w)) ++traced;
+        sim.sample_trajectories();
+    }
+    BackgroundCheckpoint ckpt;
+    const std::string ckpt_path = opt.save.empty() ? "checkpoint.msc" : opt.save;
+    int ckpt_shown = -1; // последний напечатанный десяток процентов
+    auto poll_checkpoint = [&]() {
+        int r = ckpt.poll();
+        if (ckpt.active() && ckpt.progress / 10 != ckpt_shown) {
+            ckpt_shown = ckpt.progress / 10;
+            std::cerr << "контрольная точка " << ckpt.generation << ": " << ckpt_shown * 10 << "%\n";
+        }
+        if (r == 0) return true;
+        ckpt_shown = -1;
+        std::cout << "checkpoint gen " << ckpt.generation << (r > 0 ? " ok" : " failed") << " pause_ms " << ckpt.pause_ms
+            << " write_ms " << ckpt.write_ms << '\n';
+        return r > 0;
+    };
+    // Без покадровых потребителей поколения считаются пачками до ближайшего отчёта (Margolus::advance)
+    const bool batched = opt.steps > 0 && opt.npy.empty() && opt.archive.empty() && opt.metrics_port <= 0
+        && opt.trace <= 0 && opt.checkpoint_every <= 0;
+    if (opt.threads > 0) sim.threads = opt.threads;
+    sim.layout = opt.layout;
+    const long long start_gen = sim.generation;
+    if (opt.steps <= 0) install_headless_stop();
+    for (long long g = 1; opt.steps <= 0 ? !headless_stop : g <= opt.steps; ++g) {
+        if (batched) {
+            const long long MAX_BATCH = 1024; // пачка ограничена и без --every
+            long long n = std::min(MAX_BATCH, opt.steps - g + 1);
+            if (opt.every > 0) n = std::min(n, opt.every - (g - 1) % opt.every);
+            sim.advance(n);
+            g += n - 1;
+            if (opt.every > 0 && g % opt.every == 0) report();
+            flush_flux(false);
+            continue;
+        }
+        uint64_t t0 = opt.metrics_port > 0 ? now_ns() : 0;
+        sim.step();
+        if (opt.metrics_port > 0) {
+            metrics.record_step(sim, now_ns() - t0);
+            metrics.npy_queue.store(npy.depth.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            if ((g & 255) == 0) metrics.memory_bytes.store(sim.memory_bytes(), std::memory_order_relaxed);
+        }
+        if (opt.trace > 0) sim.sample_trajectories();
+        npy.push(sim);
+        archive.push(sim);
+        if (opt.every > 0 && g % opt.every == 0) report();
+        flush_flux(false);
+        if (opt.checkpoint_every > 0) {
+            poll_checkpoint();
+            if (g % opt.checkpoint_every == 0 && !ckpt.start(sim, ckpt_path))
+                std::cerr << "контрольная точка " << sim.generation << " пропущена: идёт запись " << ckpt.generation << '\n';
+        }
+    }
+    while (ckpt.active()) {
+        if (!poll_checkpoint()) return 1;
+        if (ckpt.active()) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    if (opt.every <= 0 || (sim.generation - start_gen) % opt.every != 0) report(); // при --headless 0 — последнее состояние
+    for (const auto& p : sim.trajectories)
+        std::cout << "trace " << p.gen << ' ' << p.id << ' ' << p.x << ' ' << p.y << '\n';
+    for (size_t i = 0; i < sim.probes.size(); ++i)
+        std::cout << "probe " << i << " total " << sim.probes[i].total << '\n';
+    if (!opt.archive.empty()) {
+        if (!archive.close()) {
+            std::cerr << "ошибка записи " << opt.archive << '\n';
+            return 1;
+        }
+        std::cout << "archive " << archive.index.size() << " chunks, raw " << archive.raw_total
+            << " bytes, packed " << archive.packed_total << " bytes\n";
+        if (opt.verify) {
+            if (!verify_archive(opt.archive, sim)) {
+                std::cerr << "проверка " << opt.archive << " не пройдена\n";
+                return 1;
+            }
+            std::cout << "archive " << sim.generation << " generations verified\n";
+        }
+    }
+    if (!opt.save.empty() && !save_checkpoint(sim, opt.save)) {
+        std::cerr << "ошибка записи " << opt.save << '\n';
+        return 1;
+    }
+    if (!npy.close()) {
+        std::cerr << "ошибка записи " << opt.npy << '\n';
+        return 1;
+    }
+    if (opt.verify && !opt.npy.empty()) {
+        if (!verify_npy(opt.npy, npy, sim)) {
+            std::cerr << "проверка " << opt.npy << " не пройдена\n";
+            return 1;
+        }
+        std::cout << "npy " << npy.frames << " frames verified\n";
+    }
+    flush_flux(true);
+    if (flux.is_open() && !flux.good()) {
+        std::cerr << "не удалось записать " << opt.flux_csv << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+// Проверка наличия флага в командной строке
+bool has_flag(int argc, char** argv, const std::string& flag) {
+    for (int i = 1; i < argc; ++i)
+        if (flag == argv[i]) return true;
+    return false;
+}
+
+// Целочисленное значение параметра командной строки (def, если параметр не указан)
+int int_arg(int argc, char** argv, const std::string& name, int def) {
+    for (int i = 1; i + 1 < argc; ++i)
+        if (name == argv[i]) return std::atoi(argv[i + 1]);
+    return def;
+}
+
+int main(int argc, char** argv) {
+
+    HeadlessOptions hopt;
+    if (parse_headless(argc, argv, hopt)) return run_headless(hopt);
+
+    // Совместное редактирование: --host PORT или --join PORT (127.0.0.1)
+    int host_port = int_arg(argc, argv, "--host", 0), join_port = int_arg(argc, argv, "--join", 0);
+
+    // Режим сравнения A/B: два набора правил с одного начального состояния, рядом в одном окне
+    bool ab_mode = has_flag(argc, argv, "--ab");
+    if (ab_mode && (host_port > 0 || join_port > 0)) {
+        std::cerr << "режим A/B недоступен при совместном редактировании\n";
+        ab_mode = false;
+    }
+    int views = ab_mode ? 2 : 1;
 
-    int win_w = GRID_W * CELL_SIZE;
+    int win_w = GRID_W * CELL_SIZE * views;
     int win_h = GRID_H * CELL_SIZE;
 
-    sf::RenderWindow window(sf::VideoMode(win_w, win_h), "Margolus: Sand (SFML)");
+    sf::RenderWindow window(sf::VideoMode(win_w, win_h), ab_mode ? "Margolus: Sand A/B (SFML)" : "Margolus: Sand (SFML)");
     window.setFramerateLimit(60);
 
+    // --materials: правила выводятся из материалов (вода и масло в дополнение к песку)
+    bool materials = has_flag(argc, argv, "--materials");
     Margolus sim(GRID_W, GRID_H);
+    if (materials) sim.set_rules(build_material_rules(default_materials()));
+    sim.enable_area_sums(1); // число зёрен в выделении на информационной панели
     sim.randomize(0.09);
+    int rules_id = materials ? 2 : 0; // текущий набор правил (rule_set), клавиша L
+
+    Lockstep net;
+    net.rules_id = rules_id;
+    if (host_port > 0 && !net.host(host_port)) std::cerr << "не удалось открыть порт " << host_port << '\n';
+    else if (host_port <= 0 && join_port > 0 && !net.join(join_port))
+        std::cerr << "не удалось подключиться к 127.0.0.1:" << join_port << '\n';
+
+    // Второй автомат (вариант B) считается в отдельном потоке параллельно с первым
+    Margolus sim_b(ab_mode ? GRID_W : 0, ab_mode ? GRID_H : 0);
+    std::unique_ptr<StepWorker> worker_b;
+    TileDivergence divergence(GRID_W, GRID_H);
+    if (ab_mode) {
+        std::vector<Rule> rules_b = sim.rules;
+        for (auto& r : rules_b) r.horizontal_reflection = false; // как build_sand_rules_asymmetric()
+        sim_b.set_rules(rules_b);
+        sim_b.copy_state(sim);
+        worker_b.reset(new StepWorker());
+    }
+
+    // Конвейер кадра: пока основной поток переводит поколение N в вершины, фоновый поток считает
+    // следующую пачку шагов. Отрисовка читает копию сетки (render_cells), снятую до запуска пачки.
+    // В режиме A/B второй поток уже занят автоматом B, а участник совместного редактирования
+    // применяет команды между шагами — в этих случаях шаги идут после кадра, как раньше.
+    const bool pipelined = !ab_mode && net.role != Lockstep::Client;
+    std::unique_ptr<StepWorker> worker_steps;
+    std::vector<Cell> render_cells;
+    if (pipelined) {
+        worker_steps.reset(new StepWorker());
+        render_cells = sim.cells;
+    }
+
+    // Необязательный сервер метрик (Prometheus) на 127.0.0.1
+    SimMetrics metrics;
+    MetricsServer metrics_server(metrics);
+    int metrics_port = int_arg(argc, argv, "--metrics-port", 0);
+    if (metrics_port > 0) {
+        metrics.states = int(sim.population.size());
+        if (!metrics_server.start(metrics_port))
+            std::cerr << "не удалось открыть порт метрик " << metrics_port << '\n';
+    }
 
     bool running = true;
     float accumulator = 0.f;
     float step_interval = 0.05f; // шаг автомата (секунд на итерацию)
 
     // Вершинный массив для быстрого рисования
-    sf::VertexArray verts(sf::Quads, GRID_W * GRID_H * 4);
-
-    auto update_vertices = [&](void) {
-        int idx = 0;
-        for (int y = 0; y < GRID_H; ++y) {
-            for (int x = 0; x < GRID_W; ++x) {
-                sf::Color c = color_for_state(sim.at(x, y));
-                float fx = x * CELL_SIZE;
+    sf::VertexArray verts(sf::Quads, GRID_W * GRID_H * 4 * views);
+    sf::VertexArray overlay(sf::Quads); // подсветка расходящихся тайлов
+
+    // Перевод прямоугольника сетки [x0, x1] × [y0, y1] в вершины
+    auto fill_vertices = [&](const std::vector<Cell>& cells, int base, float x_off, int x0, int y0, int x1, int y1) {
+        for (int y = y0; y <= y1; ++y) {
+            int idx = base + (y * GRID_W + x0) * 4;
+            for (int x = x0; x <= x1; ++x) {
+                sf::Color c = color_for_state(cells[y * GRID_W + x]);
+                float fx = x_off + x * CELL_SIZE;
                 float fy = y * CELL_SIZE;
                 verts[idx + 0].position = sf::Vector2f(fx, fy);
                 verts[idx + 1].position = sf::Vector2f(fx + CELL_SIZE, fy);
@@ -188,7 +3842,124 @@ int main() {
         }
         };
 
-    update_vertices();
+    auto update_vertices = [&](int x0, int y0, int x1, int y1) {
+        fill_vertices(pipelined ? render_cells : sim.cells, 0, 0.f, x0, y0, x1, y1);
+        if (!ab_mode) return;
+        fill_vertices(sim_b.cells, GRID_W * GRID_H * 4, float(GRID_W * CELL_SIZE), x0, y0, x1, y1);
+        divergence.update(sim, sim_b);
+        overlay.clear();
+        sf::Color tint(255, 0, 0, 70);
+        float ts = float(divergence.tile * CELL_SIZE);
+        for (int ty = 0; ty < divergence.tiles_y; ++ty)
+            for (int tx = 0; tx < divergence.tiles_x; ++tx) {
+                if (!divergence.diverged[size_t(ty) * divergence.tiles_x + tx]) continue;
+                for (int v = 0; v < views; ++v) {
+                    float fx = v * GRID_W * CELL_SIZE + tx * ts, fy = ty * ts;
+                    overlay.append(sf::Vertex{ sf::Vector2f(fx, fy), tint });
+                    overlay.append(sf::Vertex{ sf::Vector2f(fx + ts, fy), tint });
+                    overlay.append(sf::Vertex{ sf::Vector2f(fx + ts, fy + ts), tint });
+                    overlay.append(sf::Vertex{ sf::Vector2f(fx, fy + ts), tint });
+                }
+            }
+        };
+
+    // Политика показа: сетка переводится в вершины не чаще одного раза за кадр дисплея и только
+    // если что-то изменилось; пачки шагов помечают устаревшим весь кадр, правки — свой прямоугольник.
+    // Пока окно свёрнуто, перевод и отрисовка пропускаются, симуляция продолжается.
+    bool grid_dirty = true;
+    std::array<int, 4> dirty_box{ GRID_W, GRID_H, -1, -1 }; // пустой прямоугольник
+    // Свёрнутое окно: на Windows — IsIconic, иначе — только по событию Resized с нулевым размером,
+    // которое X11 и Wayland обычно не присылают. Окно, закрытое другими окнами, не распознаётся:
+    // у SFML нет сведений о перекрытии, а потеря фокуса не значит, что окно не видно.
+    bool window_hidden = false;
+    uint64_t input_t0 = 0; // время первой ещё не показанной правки пользователя (замер задержки)
+
+    // Мазок кистью сразу записывается в вершины, не дожидаясь применения автоматом и перевода сетки.
+    // Участник совместного редактирования применит правку только после ответа ведущего, поэтому
+    // его мазки повторно накладываются поверх сетки в течение PREVIEW_NS.
+    const uint64_t PREVIEW_NS = 150000000;
+    std::vector<std::pair<uint64_t, std::array<int, 3>>> preview; // время, {x, y, состояние}
+    auto preview_cell = [&](int x, int y, int state) {
+        sf::Color c = color_for_state(state);
+        for (int v = 0; v < views; ++v) {
+            int idx = v * GRID_W * GRID_H * 4 + (y * GRID_W + x) * 4;
+            for (int k = 0; k < 4; ++k) verts[idx + k].color = c;
+        }
+        };
+
+    // Применение команды редактирования; в режиме A/B — в обоих автоматах (правила B не меняются)
+    auto apply_local = [&](const EditCommand& c) {
+        std::array<int, 4> box = apply_edit(sim, c);
+        if (c.type == EditCommand::Rules) rules_id = c.state;
+        auto add_box = [&](const std::array<int, 4>& b) {
+            dirty_box = { std::min(dirty_box[0], b[0]), std::min(dirty_box[1], b[1]),
+                std::max(dirty_box[2], b[2]), std::max(dirty_box[3], b[3]) };
+            };
+        add_box(box);
+        if (!ab_mode || c.type == EditCommand::Rules) return;
+        // заливка в B затрагивает свою область, которая может отличаться от области A
+        std::array<int, 4> box_b = apply_edit(sim_b, c);
+        add_box(box_b);
+        divergence.mark_box(divergence.dirty_a, box);
+        divergence.mark_box(divergence.dirty_a, box_b);
+        };
+
+    // Правка пользователя: при совместном редактировании участник применяет её, когда она вернётся от ведущего
+    auto edit = [&](const EditCommand& c) {
+        if (!input_t0) input_t0 = now_ns();
+        if (c.type == EditCommand::Paint) {
+            preview_cell(c.x, c.y, c.state);
+            if (net.role == Lockstep::Client) preview.push_back({ now_ns(), { c.x, c.y, c.state } });
+        }
+        if (net.submit(sim, c)) apply_local(c);
+        };
+
+    // Общий сброс состояния в режиме A/B
+    auto sync_b = [&] {
+        if (!ab_mode) return;
+        sim_b.copy_state(sim);
+        std::fill(divergence.dirty_a.begin(), divergence.dirty_a.end(), 1);
+        };
+
+    PerfCounters perf;
+    PerfHud hud;
+    BackgroundCheckpoint checkpoint; // клавиша F5
+    std::wstring checkpoint_status;
+
+    // Средняя длительность шага (для ограничения пачки бюджетом кадра)
+    const double BATCH_BUDGET_NS = 10e6;
+    double step_avg_ns = 0.0;
+
+    // Пачка кадра считается через advance() в sim.threads потоках; иначе — по шагу в потоке каждого варианта
+    auto batched_steps = [&]() { return !ab_mode && net.role == Lockstep::Off && metrics_port <= 0; };
+    // Пачка шагов: в режиме A/B автомат B считается в фоновом потоке одновременно с A
+    auto run_steps = [&](int steps) {
+        uint64_t t0 = now_ns();
+        if (ab_mode) worker_b->run([&, steps] {
+            uint64_t b0 = now_ns();
+            for (int i = 0; i < steps; ++i) { sim_b.step(); divergence.mark_changes(divergence.dirty_b, sim_b); }
+            perf.add(perf.busy_ns[1], now_ns() - b0);
+            });
+        // без покадровых потребителей вся пачка идёт волновым фронтом по полосам
+        const bool batched = batched_steps();
+        if (batched) sim.advance(steps);
+        else for (int i = 0; i < steps; ++i) {
+            if (net.role == Lockstep::Client) net.apply_due(sim, apply_local);
+            uint64_t s0 = metrics_port > 0 ? now_ns() : 0;
+            sim.step();
+            if (metrics_port > 0) metrics.record_step(sim, now_ns() - s0);
+            if (ab_mode) divergence.mark_changes(divergence.dirty_a, sim);
+            net.after_step(sim);
+        }
+        net.end_batch(sim);
+        if (metrics_port > 0) metrics.memory_bytes.store(sim.memory_bytes() + sim_b.memory_bytes(), std::memory_order_relaxed);
+        perf.add(perf.busy_ns[0], batched ? sim.busy_ns : now_ns() - t0);
+        if (ab_mode) worker_b->wait();
+        perf.add(perf.step_ns, now_ns() - t0);
+        if (steps > 0) step_avg_ns = 0.8 * step_avg_ns + 0.2 * double(now_ns() - t0) / steps;
+        perf.add(perf.generations, uint64_t(steps));
+        perf.add(perf.cell_updates, uint64_t(steps) * GRID_W * GRID_H * views);
+        };
 
     // Текстовая информация
     sf::Font font;
@@ -201,7 +3972,58 @@ int main() {
     info_text.setFillColor(sf::Color::White);
     info_text.setPosition(6, 6);
 
+    sf::Text hud_text; // панель производительности (клавиша P)
+    hud_text.setFont(font);
+    hud_text.setCharacterSize(14);
+    hud_text.setFillColor(sf::Color(120, 255, 120));
+    hud_text.setPosition(6, float(win_h - 86));
+
     int brush_state = 1; // состояние, которое рисуется при клике
+    uint64_t world_seed = 0; // seed последнего сгенерированного мира (клавиша G)
+
+    // Выделение (Ctrl + ЛКМ), буфер обмена и библиотека штампов
+    bool selecting = false, has_selection = false;
+    int sel[4] = { 0, 0, 0, 0 }; // угол начала и текущий угол выделения
+    std::shared_ptr<Region> clipboard;
+    const std::string stamp_dir = "stamps";
+    auto stamps = load_stamp_library(stamp_dir);
+    int stamp_idx = -1;
+    sf::RectangleShape sel_shape;
+    sel_shape.setFillColor(sf::Color(80, 160, 255, 40));
+    sel_shape.setOutlineColor(sf::Color(80, 160, 255));
+    sel_shape.setOutlineThickness(1.f);
+
+    auto mouse_cell = [&](int& gx, int& gy) {
+        sf::Vector2i mp = sf::Mouse::getPosition(window);
+        gx = (mp.x / CELL_SIZE) % GRID_W;
+        gy = mp.y / CELL_SIZE;
+        return mp.x >= 0 && gx >= 0 && gy >= 0 && gy < GRID_H;
+        };
+
+    // Совместное редактирование: приём команд (только в основном потоке, вне пачки шагов)
+    auto poll_net = [&] {
+        if (net.poll(sim, apply_local)) { sync_b(); grid_dirty = true; }
+        };
+
+    // Продвижение симуляции за кадр; участник считает до границы, заданной ведущим.
+    // Может выполняться в worker_steps, поэтому не трогает отрисовку — возвращает, сделаны ли шаги.
+    auto advance = [&] {
+        if (net.role == Lockstep::Client) {
+            accumulator = 0.f;
+            int steps = int(std::min(net.allowed(sim), 1000LL));
+            if (steps > 0) run_steps(steps);
+            return steps > 0;
+        }
+        if (!running || accumulator < step_interval) return false;
+        int steps = int(accumulator / step_interval);
+        accumulator -= steps * step_interval;
+        // пачка не длиннее бюджета кадра: отставание отбрасывается, чтобы не задерживать ввод
+        int budget = std::max(1, int(BATCH_BUDGET_NS / std::max(1.0, step_avg_ns)));
+        if (steps > budget) { steps = budget; accumulator = 0.f; }
+        run_steps(steps);
+        return true;
+        };
+    bool advanced = false; // результат фоновой пачки (читается после worker_steps->wait())
 
     sf::Clock clock;
 
@@ -212,63 +4034,197 @@ int main() {
         sf::Event ev;
         while (window.pollEvent(ev)) {
             if (ev.type == sf::Event::Closed) window.close();
+            else if (ev.type == sf::Event::Resized) window_hidden = ev.size.width == 0 || ev.size.height == 0;
             else if (ev.type == sf::Event::KeyPressed) {
-                if (ev.key.code == sf::Keyboard::Space) running = !running;
-                else if (ev.key.code == sf::Keyboard::S) { sim.step(); update_vertices(); }
-                else if (ev.key.code == sf::Keyboard::C) { sim.clear(); update_vertices(); }
-                else if (ev.key.code == sf::Keyboard::R) { sim.randomize(0.09); update_vertices(); }
+                int gx, gy;
+                if (ev.key.control && ev.key.code == sf::Keyboard::C) {
+                    if (has_selection)
+                        clipboard = std::make_shared<Region>(sim.copy_region(std::min(sel[0], sel[2]), std::min(sel[1], sel[3]),
+                            std::max(sel[0], sel[2]), std::max(sel[1], sel[3])));
+                }
+                else if (ev.key.control && ev.key.code == sf::Keyboard::V) {
+                    if (clipboard && mouse_cell(gx, gy)) {
+                        EditCommand c{ EditCommand::Paste, gx, gy, 0, nullptr };
+                        c.region = clipboard;
+                        edit(c);
+                    }
+                }
+                else if (ev.key.control && ev.key.code == sf::Keyboard::S) {
+                    // сохранение буфера обмена в библиотеку штампов
+                    if (clipboard) {
+                        std::error_code ec;
+                        std::filesystem::create_directories(stamp_dir, ec);
+                        // первое свободное имя: файлы могли удалить, а встроенные штампы занимают номера
+                        std::string name;
+                        for (size_t n = 0; name.empty() || std::filesystem::exists(stamp_dir + "/" + name + ".msc", ec)
+                            || std::any_of(stamps.begin(), stamps.end(), [&](const auto& st) { return st.first == name; }); ++n)
+                            name = "stamp_" + std::to_string(n);
+                        if (save_stamp(*clipboard, stamp_dir + "/" + name + ".msc")) stamps.push_back({ name, *clipboard });
+                    }
+                }
+                else if (ev.key.code == sf::Keyboard::Q) { if (clipboard) clipboard = std::make_shared<Region>(clipboard->rotated()); }
+                else if (ev.key.code == sf::Keyboard::M) { if (clipboard) clipboard = std::make_shared<Region>(clipboard->mirrored()); }
+                else if (ev.key.code == sf::Keyboard::PageUp || ev.key.code == sf::Keyboard::PageDown) {
+                    if (!stamps.empty()) {
+                        int n = int(stamps.size());
+                        stamp_idx = ((ev.key.code == sf::Keyboard::PageDown ? stamp_idx + 1 : stamp_idx - 1) % n + n) % n;
+                        clipboard = std::make_shared<Region>(stamps[stamp_idx].second);
+                    }
+                }
+                else if (ev.key.code == sf::Keyboard::F5) checkpoint.start(sim, "checkpoint.msc");
+                else if (ev.key.code == sf::Keyboard::F9) {
+                    // загрузка разошлась бы с другими участниками
+                    if (net.role == Lockstep::Off && load_checkpoint(sim, "checkpoint.msc")) { sync_b(); grid_dirty = true; }
+                }
+                else if (ev.key.code == sf::Keyboard::Space) running = !running;
+                else if (ev.key.code == sf::Keyboard::S) {
+                    if (net.role != Lockstep::Client) { run_steps(1); grid_dirty = true; }
+                }
+                else if (ev.key.code == sf::Keyboard::C) edit(EditCommand{ EditCommand::Clear, 0, 0, 0, nullptr });
+                else if (ev.key.code == sf::Keyboard::R) edit(EditCommand{ EditCommand::Randomize, 0, 0, 90, nullptr });
+                else if (ev.key.code == sf::Keyboard::G) edit(EditCommand{ EditCommand::World, int(++world_seed), 0, 0, nullptr }); // мир со следующим seed
+                else if (ev.key.code == sf::Keyboard::L) edit(EditCommand{ EditCommand::Rules, 0, 0, (rules_id + 1) % RULE_SETS, nullptr });
                 else if (ev.key.code == sf::Keyboard::Num1) brush_state = 0;
                 else if (ev.key.code == sf::Keyboard::Num2) brush_state = 1;
                 else if (ev.key.code == sf::Keyboard::Num3) brush_state = 2;
                 else if (ev.key.code == sf::Keyboard::Num4) brush_state = 3;
+                else if (ev.key.code == sf::Keyboard::Num5 && rules_id == 2) brush_state = 4;
+                else if (ev.key.code == sf::Keyboard::Num6 && rules_id == 2) brush_state = 5;
                 else if (ev.key.code == sf::Keyboard::Up) step_interval = std::max(0.005f, step_interval - 0.01f);
                 else if (ev.key.code == sf::Keyboard::Down) step_interval += 0.01f;
+                else if (ev.key.code == sf::Keyboard::P) hud.visible = !hud.visible;
+                else if (ev.key.code == sf::Keyboard::F) {
+                    // заливка области под курсором состоянием кисти
+                    sf::Vector2i mp = sf::Mouse::getPosition(window);
+                    int gx = (mp.x / CELL_SIZE) % GRID_W;
+                    int gy = mp.y / CELL_SIZE;
+                    if (gx >= 0 && gy >= 0 && gy < GRID_H) edit(EditCommand{ EditCommand::Fill, gx, gy, brush_state, nullptr });
+                }
+            }
+            else if (ev.type == sf::Event::MouseButtonPressed && ev.mouseButton.button == sf::Mouse::Left
+                && sf::Keyboard::isKeyPressed(sf::Keyboard::LControl)) {
+                int gx, gy;
+                if (mouse_cell(gx, gy)) {
+                    selecting = has_selection = true;
+                    sel[0] = sel[2] = gx;
+                    sel[1] = sel[3] = gy;
+                }
+            }
+            else if (ev.type == sf::Event::MouseButtonReleased && ev.mouseButton.button == sf::Mouse::Left) selecting = false;
+            else if (selecting && ev.type == sf::Event::MouseMoved) {
+                int gx, gy;
+                if (mouse_cell(gx, gy)) { sel[2] = gx; sel[3] = gy; }
             }
             else if (ev.type == sf::Event::MouseButtonPressed || ev.type == sf::Event::MouseMoved) {
                 if (sf::Mouse::isButtonPressed(sf::Mouse::Left)) {
                     sf::Vector2i mp = sf::Mouse::getPosition(window);
-                    int gx = mp.x / CELL_SIZE;
+                    int gx = (mp.x / CELL_SIZE) % GRID_W; // в режиме A/B рисовать можно в любой половине
                     int gy = mp.y / CELL_SIZE;
                     if (gx >= 0 && gx < GRID_W && gy >= 0 && gy < GRID_H) {
-                        sim.at(gx, gy) = brush_state;
-                        update_vertices();
+                        edit(EditCommand{ EditCommand::Paint, gx, gy, brush_state, nullptr });
                     }
                 }
                 if (sf::Mouse::isButtonPressed(sf::Mouse::Right)) {
                     sf::Vector2i mp = sf::Mouse::getPosition(window);
-                    int gx = mp.x / CELL_SIZE;
+                    int gx = (mp.x / CELL_SIZE) % GRID_W; // в режиме A/B рисовать можно в любой половине
                     int gy = mp.y / CELL_SIZE;
                     if (gx >= 0 && gx < GRID_W && gy >= 0 && gy < GRID_H) {
                         // циклическая смена состояния ячейки
-                        sim.at(gx, gy) = (sim.at(gx, gy) + 1) % 4;
-                        update_vertices();
+                        edit(EditCommand{ EditCommand::Paint, gx, gy, (sim.at(gx, gy) + 1) % (rules_id == 2 ? 6 : 4), nullptr });
                     }
                 }
             }
         }
 
-        if (running) {
-            if (accumulator >= step_interval) {
-                int steps = int(accumulator / step_interval);
-                accumulator -= steps * step_interval;
-                for (int i = 0; i < steps; ++i) sim.step();
-                update_vertices();
-            }
+#ifdef _WIN32
+        window_hidden = IsIconic(window.getSystemHandle()) != 0;
+#endif
+        if (window_hidden) {
+            window.display(); // только выдержка частоты кадров
+            input_t0 = 0;
+            poll_net();
+            if (advance()) grid_dirty = true;
+            continue;
         }
 
-        // Отрисовка
-        window.clear(sf::Color::Black);
-        window.draw(verts);
+        poll_net();
+        if (int r = checkpoint.poll())
+            checkpoint_status = L"Контрольная точка " + std::to_wstring(checkpoint.generation) + (r > 0 ? L": записана за " : L": ошибка через ")
+                + std::to_wstring(int(checkpoint.write_ms)) + L" мс, пауза " + std::to_wstring(checkpoint.pause_ms).substr(0, 5) + L" мс";
+        else if (checkpoint.active())
+            checkpoint_status = L"Контрольная точка " + std::to_wstring(checkpoint.generation) + L": " + std::to_wstring(checkpoint.progress) + L"%";
 
         // Информационная панель
-        sf::String info = L"Space: запуск/пауза  S: шаг  C: очистить  R: случайно  1-4: кисть  ЛКМ: рисовать  ПКМ: смена\n";
+        sf::String info = L"Space: запуск/пауза  S: шаг  C: очистить  R: случайно  G: мир  L: правила  1-4: кисть  ЛКМ: рисовать  ПКМ: смена  F: заливка  P: производительность\n";
         info += L"Скорость (Up/Down): " + std::to_wstring(int(1.0f / step_interval)) + L" шагов/сек\n";
-        info += L"Состояние кисти: " + std::to_wstring(brush_state) + L" (0 — пусто, 1 — песок, 2 — грунт, 3 — источник)";
+        info += L"Состояние кисти: " + std::to_wstring(brush_state) + L" (0 — пусто, 1 — песок, 2 — грунт, 3 — источник"
+            + std::wstring(rules_id == 2 ? L", 4 — вода, 5 — масло)" : L")");
+        if (clipboard) {
+            info += L"\nБуфер: " + std::to_wstring(clipboard->w) + L"x" + std::to_wstring(clipboard->h);
+            if (stamp_idx >= 0) info += L" (" + sf::String(stamps[stamp_idx].first) + L")";
+            info += L"  Ctrl+V: вставить  Q: повернуть  M: отразить  Ctrl+S: в библиотеку";
+        }
+        if (ab_mode)
+            info += L"\nA/B: расходится " + std::to_wstring(divergence.diverged_count) + L" из "
+                + std::to_wstring(divergence.tiles_x * divergence.tiles_y) + L" тайлов";
+        if (net.role != Lockstep::Off) {
+            info += net.role == Lockstep::Host ? L"\nВедущий: участников " + std::to_wstring(net.peers.size())
+                : L"\nУчастник: граница " + std::to_wstring(net.frontier);
+            info += L", поколение " + std::to_wstring(sim.generation) + L", отправлено " + std::to_wstring(net.bytes_sent)
+                + L" Б, принято " + std::to_wstring(net.bytes_received) + L" Б";
+            if (net.desync_gen >= 0) info += L"  РАССИНХРОНИЗАЦИЯ (поколение " + std::to_wstring(net.desync_gen) + L")";
+        }
+        if (has_selection) {
+            int x0 = std::min(sel[0], sel[2]), y0 = std::min(sel[1], sel[3]);
+            int x1 = std::max(sel[0], sel[2]) + 1, y1 = std::max(sel[1], sel[3]) + 1;
+            info += L"\nВыделение " + std::to_wstring(x1 - x0) + L"x" + std::to_wstring(y1 - y0) + L": песок "
+                + std::to_wstring(sim.count_in_rect(1, x0, y0, x1, y1));
+        }
+        if (!checkpoint_status.empty()) info += L"\n" + checkpoint_status;
         info_text.setString(info);
+        if (hud.visible && hud.due() && hud.sample(perf, batched_steps() ? std::max(1, sim.threads) : views, active_tile_share(sim), sim.memory_bytes() + sim_b.memory_bytes()
+            + verts.getVertexCount() * sizeof(sf::Vertex)))
+            hud_text.setString(hud.text);
+
+        // Снимок поколения N для отрисовки и запуск следующей пачки в фоне; панель выше уже прочитала автомат
+        if (pipelined) {
+            if (grid_dirty) render_cells = sim.cells;
+            else if (dirty_box[2] >= 0)
+                for (int y = dirty_box[1]; y <= dirty_box[3]; ++y)
+                    std::copy(sim.cells.begin() + size_t(y) * GRID_W + dirty_box[0], sim.cells.begin() + size_t(y) * GRID_W + dirty_box[2] + 1,
+                        render_cells.begin() + size_t(y) * GRID_W + dirty_box[0]);
+            worker_steps->run([&] { advanced = advance(); });
+        }
+
+        // Отрисовка — до (или одновременно с) пачкой шагов, чтобы правки этого кадра показывались,
+        // не дожидаясь шагов; результат шагов появится в следующем кадре
+        uint64_t render_t0 = now_ns();
+        if (grid_dirty) update_vertices(0, 0, GRID_W - 1, GRID_H - 1);
+        else if (dirty_box[2] >= 0) update_vertices(dirty_box[0], dirty_box[1], dirty_box[2], dirty_box[3]);
+        grid_dirty = false;
+        dirty_box = { GRID_W, GRID_H, -1, -1 };
+        while (!preview.empty() && render_t0 - preview.front().first > PREVIEW_NS) preview.erase(preview.begin());
+        for (const auto& p : preview) preview_cell(p.second[0], p.second[1], p.second[2]);
+        window.clear(sf::Color::Black);
+        window.draw(verts);
+        if (ab_mode) window.draw(overlay);
+        if (has_selection) {
+            int x0 = std::min(sel[0], sel[2]), y0 = std::min(sel[1], sel[3]);
+            sel_shape.setPosition(float(x0 * CELL_SIZE), float(y0 * CELL_SIZE));
+            sel_shape.setSize(sf::Vector2f(float((std::abs(sel[2] - sel[0]) + 1) * CELL_SIZE), float((std::abs(sel[3] - sel[1]) + 1) * CELL_SIZE)));
+            window.draw(sel_shape);
+        }
 
         if (font.getInfo().family != "") window.draw(info_text);
+        if (hud.visible && font.getInfo().family != "") window.draw(hud_text);
+        perf.add(perf.render_ns, now_ns() - render_t0);
+        perf.add(perf.frames, 1);
 
         window.display();
+        if (input_t0) { perf.add_latency(now_ns() - input_t0); input_t0 = 0; }
+        if (pipelined) worker_steps->wait();
+        else advanced = advance();
+        if (advanced) grid_dirty = true;
     }
 
     return 0;